@@ -0,0 +1,866 @@
+/*
+ * bench.c
+ *
+ * Copyright (C) 2014 LSI Logic
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+  Microbenchmarks of the CPU bound parts of libbspimage, without flash.
+
+  Synthetic images are generated in memory, written to unlinked temporary
+  files and opened with bspimage_open_file(), so they are mapped and the
+  decoders only see page cache.  Each benchmark is timed in runs of at
+  least RUN_NANOSECONDS, the fastest of RUNS is kept.  A result over its
+  tolerance is measured again, up to ATTEMPTS times, keeping the fastest,
+  as is every result saved as a baseline.  Cycles, instructions and cache
+  misses come from perf_event_open() when the kernel allows it, "-"
+  otherwise.
+
+  Results are compared against a baseline file of "NAME NS_PER_BYTE
+  INSTRUCTIONS_PER_BYTE" lines, see "make bench", saved the same way.
+  When both the baseline and this run have the instruction count it is
+  the figure compared, with INSTRUCTION_TOLERANCE, as it hardly varies
+  from run to run.  Otherwise the time is compared, with the -tolerance,
+  which has to be wide enough for a shared machine, or a wider one for
+  the benchmarks of tiny calls and of images.  These still catch the
+  slow downs that matter, a lock or a copy per call, but not a few
+  percent.  A benchmark over its tolerance is a regression, and the exit
+  status is 1.  The baseline only means something on the machine, and
+  with the CFLAGS, it was saved with.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+#include "util.h"
+#include "bspimage.h"
+#include "config.h"
+
+/*
+  ==============================================================================
+  Local
+  ==============================================================================
+*/
+
+#define RUNS 15
+#define ATTEMPTS 4
+#define ATTEMPT_PAUSE 200000	/* us between them, past a busy spell */
+#define RUN_NANOSECONDS 10000000ULL
+#define MAX_BENCHMARKS 32
+#define COUNTERS 3
+#define INSTRUCTION_TOLERANCE 2
+#define TIME_TOLERANCE 25
+#define SHORT_TIME_TOLERANCE 75	/* runs of tiny calls, mostly call overhead */
+#define IMAGE_TIME_TOLERANCE 100	/* memory bound, varies most between runs */
+
+typedef struct benchmark {
+	char name[32];
+	void (*run)(struct benchmark *);
+	bspimage_t *image;
+	unsigned char *data;
+	unsigned long length;
+	unsigned long bytes;	/* per run, for the per byte figures */
+	double ns_per_byte;
+	double tolerance;	/* in time, percent, 0 for the -tolerance */
+	double counters[COUNTERS];	/* per byte, negative if unavailable */
+} benchmark_t;
+
+static benchmark_t benchmarks_[MAX_BENCHMARKS];
+static int benchmark_count_;
+static volatile unsigned long sink_;
+static FILE *null_;
+static int perf_fd_ = -1;
+static int perf_fds_[COUNTERS];
+
+/*
+  ------------------------------------------------------------------------------
+  now
+*/
+
+static unsigned long long
+now(void)
+{
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return (unsigned long long)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  perf_open
+
+  Opens cycles, instructions and cache misses as one group, counting
+  this thread in user space.
+*/
+
+static void
+perf_open(void)
+{
+	static const unsigned long long events[COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES
+	};
+	struct perf_event_attr attr;
+	int counter;
+
+	for (counter = 0; counter < COUNTERS; ++counter) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = events[counter];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = (0 == counter);
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		perf_fds_[counter] = syscall(__NR_perf_event_open, &attr, 0, -1,
+					     perf_fd_, 0);
+
+		if (0 > perf_fds_[counter]) {
+			while (0 < counter--)
+				close(perf_fds_[counter]);
+
+			perf_fd_ = -1;
+
+			return;
+		}
+
+		if (0 == counter)
+			perf_fd_ = perf_fds_[0];
+	}
+}
+
+/*
+  ------------------------------------------------------------------------------
+  perf_read
+*/
+
+static int
+perf_read(unsigned long long *values)
+{
+	unsigned long long group[1 + COUNTERS];
+
+	if (0 > perf_fd_ ||
+	    sizeof(group) != read(perf_fd_, group, sizeof(group)) ||
+	    COUNTERS != group[0])
+		return -1;
+
+	memcpy(values, &group[1], COUNTERS * sizeof(unsigned long long));
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  fill_random
+
+  xorshift, so the inputs are the same on every run.
+*/
+
+static void
+fill_random(unsigned char *data, unsigned long length, uint32_t seed)
+{
+	unsigned long index;
+
+	for (index = 0; index < length; ++index) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		/* no NULs or '_', so no string looks like a key */
+		data[index] = 0x60 + (seed & 0x1f);
+	}
+}
+
+/*
+  ------------------------------------------------------------------------------
+  open_synthetic
+
+  Opens data as an image file, which is gone once the handle is closed.
+*/
+
+static bspimage_t *
+open_synthetic(const char *type, const char *asic,
+	       const void *data, unsigned long length)
+{
+	char path[] = "/tmp/benchXXXXXX";
+	bspimage_t *image;
+	int fd;
+
+	if (0 > (fd = mkstemp(path))) {
+		fprintf(stderr, "Unable to create %s : %s\n", path,
+			strerror(errno));
+
+		return NULL;
+	}
+
+	if (length != write(fd, data, length)) {
+		fprintf(stderr, "Unable to write %s : %s\n", path,
+			strerror(errno));
+		close(fd);
+		unlink(path);
+
+		return NULL;
+	}
+
+	close(fd);
+	image = bspimage_open_file(type, asic, path);
+	unlink(path);
+
+	return image;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  make_uboot
+
+  A legacy image with the version string 7/8 of the way in, and the atf
+  one after it, so finding them scans most of the image.
+*/
+
+static unsigned char *
+make_uboot(unsigned long length, const char *version, const char *atf)
+{
+	unsigned char *data;
+	uint32_t *header;
+
+	if (NULL == (data = malloc(length)))
+		return NULL;
+
+	fill_random(data, length, 0x2f6b3a91);
+	memset(data, 0, IH_HEADER_SIZE);
+	header = (uint32_t *)data;
+	header[0] = htonl(IH_MAGIC);
+	header[2] = htonl(0x5a000000);
+	header[3] = htonl(length - IH_HEADER_SIZE);
+	strcpy((char *)data + (length / 8) * 7, version);
+
+	if (NULL != atf)
+		strcpy((char *)data + (length / 16) * 15, atf);
+
+	return data;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  make_env
+
+  An environment of count "nameNNNN=value" variables and a valid crc32.
+*/
+
+static unsigned char *
+make_env(unsigned long length, unsigned long count)
+{
+	unsigned char *data;
+	unsigned long offset = 8;
+	unsigned long index;
+	uint32_t crc;
+
+	if (NULL == (data = calloc(1, length)))
+		return NULL;
+
+	for (index = 0; index < count; ++index)
+		offset += sprintf((char *)data + offset,
+				  "name%04lu=value of variable %lu", index, index) + 1;
+
+	crc = get_crc32(data + 8, length - 8);
+	memcpy(data, &crc, sizeof(crc));
+
+	return data;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  make_param
+
+  A parameter file with the five shown sections, sizes in words.
+*/
+
+static unsigned char *
+make_param(unsigned long *length)
+{
+	static const uint32_t sizes[BSPIMAGE_PARAM_SECTIONS] = {
+		64, 256, 64, 256, 1024
+	};
+	unsigned char *data;
+	uint32_t *header;
+	uint32_t offset = 0x100;
+	int section;
+
+	*length = offset;
+
+	for (section = 0; section < BSPIMAGE_PARAM_SECTIONS; ++section)
+		*length += sizes[section] * 4;
+
+	if (NULL == (data = malloc(*length)))
+		return NULL;
+
+	fill_random(data, *length, 0x7e11c0de);
+	memset(data, 0, offset);
+	header = (uint32_t *)data;
+	header[0] = htonl(PARAMETERS_MAGIC);
+	header[1] = htonl(*length);
+	header[3] = htonl(3);
+	header[4] = htonl(9);
+
+	/* globalOffset, globalSize ... systemMemoryOffset, systemMemorySize */
+	for (section = 0; section < BSPIMAGE_PARAM_SECTIONS; ++section) {
+		header[5 + section * 2] = htonl(offset);
+		header[6 + section * 2] = htonl(sizes[section]);
+		offset += sizes[section] * 4;
+	}
+
+	return data;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  The benchmarks
+*/
+
+static void
+run_crc32(benchmark_t *benchmark)
+{
+	sink_ += get_crc32(benchmark->data, benchmark->length);
+}
+
+static void
+run_info(benchmark_t *benchmark)
+{
+	bspimage_refresh(benchmark->image);
+	sink_ += (unsigned long)bspimage_info(benchmark->image);
+}
+
+static void
+run_env_walk(benchmark_t *benchmark)
+{
+	unsigned long offset = 0;
+
+	while (NULL != bspimage_env_next(benchmark->image, &offset))
+		++sink_;
+}
+
+static void
+run_print(benchmark_t *benchmark)
+{
+	sink_ += bspimage_print_info(null_, benchmark->image);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  add
+*/
+
+static benchmark_t *
+add(const char *name, void (*run)(benchmark_t *), unsigned long bytes)
+{
+	benchmark_t *benchmark = &benchmarks_[benchmark_count_++];
+
+	snprintf(benchmark->name, sizeof(benchmark->name), "%s", name);
+	benchmark->run = run;
+	benchmark->bytes = bytes;
+
+	return benchmark;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  setup
+*/
+
+static int
+setup(unsigned char *crc_buffer)
+{
+	static const unsigned long sizes[] = { 64, 4096, 0x10000, 0x100000 };
+	static const unsigned long alignments[] = { 0, 1, 3 };
+	benchmark_t *benchmark;
+	unsigned char *data;
+	unsigned long length;
+	char name[32];
+	int size;
+	int alignment;
+
+	for (size = 0; size < sizeof(sizes) / sizeof(sizes[0]); ++size)
+		for (alignment = 0;
+		     alignment < sizeof(alignments) / sizeof(alignments[0]);
+		     ++alignment) {
+			sprintf(name, "crc32/%lu/+%lu", sizes[size],
+				alignments[alignment]);
+			benchmark = add(name, run_crc32, sizes[size]);
+			benchmark->data = crc_buffer + alignments[alignment];
+			benchmark->length = sizes[size];
+
+			if (4096 > sizes[size])
+				benchmark->tolerance = SHORT_TIME_TOLERANCE;
+		}
+
+	/* version scans, which read most of the image */
+	length = 0x100000;
+
+	if (NULL == (data = make_uboot(length, UBOOT_KEY "2017.01 bench", NULL)))
+		return -1;
+
+	benchmark = add("uboot-version", run_info, length);
+	benchmark->image = open_synthetic("uboot", "56xx", data, length);
+	free(data);
+	length = 0x40000;
+
+	if (NULL == (data = make_uboot(length, SPL_KEY "spl 2017.01 bench",
+				       ATF_KEY "v1.3")))
+		return -1;
+
+	benchmark = add("spl-version", run_info, length);
+	benchmark->image = open_synthetic("spl", "56xx", data, length);
+	free(data);
+
+	/* the walk of "image -i env", and decoding, which is mostly crc32 */
+	length = DEFAULT_ENVIRONMENT_SIZE;
+
+	if (NULL == (data = make_env(length, 2000)))
+		return -1;
+
+	benchmark = add("env-walk", run_env_walk, length);
+	benchmark->image = open_synthetic("env", "56xx", data, length);
+	benchmark = add("env-info", run_info, length);
+	benchmark->image = open_synthetic("env", "56xx", data, length);
+	free(data);
+
+	/* the section dump of "image -i param" */
+	if (NULL == (data = make_param(&length)))
+		return -1;
+
+	benchmark = add("param-print", run_print, length);
+	benchmark->image = open_synthetic("param", "56xx", data, length);
+	free(data);
+
+	for (benchmark = benchmarks_;
+	     benchmark < &benchmarks_[benchmark_count_]; ++benchmark) {
+		if (NULL == benchmark->data && NULL == benchmark->image)
+			return -1;
+
+		if (NULL != benchmark->image)
+			benchmark->tolerance = IMAGE_TIME_TOLERANCE;
+	}
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  measure
+
+  Keeps the fastest run, of this and any earlier call.
+*/
+
+static void
+measure(benchmark_t *benchmark)
+{
+	unsigned long long before[COUNTERS];
+	unsigned long long after[COUNTERS];
+	unsigned long long start;
+	unsigned long long elapsed;
+	unsigned long long best = 0;
+	double counters[COUNTERS];
+	unsigned long iterations = 1;
+	unsigned long iteration;
+	double bytes;
+	int counted;
+	int counter;
+	int run;
+
+	/* warm up, and find how many iterations make a run */
+	for (;;) {
+		start = now();
+
+		for (iteration = 0; iteration < iterations; ++iteration)
+			benchmark->run(benchmark);
+
+		if (RUN_NANOSECONDS <= (now() - start))
+			break;
+
+		iterations *= 2;
+	}
+
+	bytes = (double)iterations * benchmark->bytes;
+
+	for (counter = 0; counter < COUNTERS; ++counter)
+		counters[counter] = -1;
+
+	for (run = 0; run < RUNS; ++run) {
+		counted = (0 == perf_read(before));
+
+		if (0 <= perf_fd_)
+			ioctl(perf_fd_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+		start = now();
+
+		for (iteration = 0; iteration < iterations; ++iteration)
+			benchmark->run(benchmark);
+
+		elapsed = now() - start;
+
+		if (0 <= perf_fd_)
+			ioctl(perf_fd_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+		counted = counted && (0 == perf_read(after));
+
+		if (0 != best && elapsed >= best)
+			continue;
+
+		best = elapsed;
+
+		for (counter = 0; counted && counter < COUNTERS; ++counter)
+			counters[counter] =
+				(after[counter] - before[counter]) / bytes;
+	}
+
+	if (0 != benchmark->ns_per_byte && benchmark->ns_per_byte <= best / bytes)
+		return;
+
+	benchmark->ns_per_byte = best / bytes;
+	memcpy(benchmark->counters, counters, sizeof(counters));
+}
+
+/*
+  ------------------------------------------------------------------------------
+  compare
+
+  Returns 1 if benchmark is slower than base by more than its tolerance,
+  by instructions when both have them, else time, with the change in
+  percent.
+*/
+
+static int
+compare(benchmark_t *benchmark, double base, double base_instructions,
+	double tolerance, double *change)
+{
+	if (0 < base_instructions && 0 <= benchmark->counters[1]) {
+		*change = (benchmark->counters[1] - base_instructions) * 100 /
+			base_instructions;
+
+		return (*change > INSTRUCTION_TOLERANCE);
+	}
+
+	*change = (benchmark->ns_per_byte - base) * 100 / base;
+
+	if (0 < benchmark->tolerance)
+		tolerance = benchmark->tolerance;
+
+	return (*change > tolerance);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  print_counter
+*/
+
+static void
+print_counter(double value, double scale)
+{
+	if (0 > value)
+		printf(" %10s", "-");
+	else
+		printf(" %10.3f", value * scale);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  baseline_get
+
+  Gets the baseline ns/byte and instructions/byte of name, returns -1 if
+  it has none.  The instructions are negative if they weren't counted.
+*/
+
+static int
+baseline_get(FILE *baseline, const char *name,
+	     double *ns_per_byte, double *instructions)
+{
+	char line[128];
+	char entry[32];
+
+	if (NULL == baseline)
+		return -1;
+
+	rewind(baseline);
+
+	while (NULL != fgets(line, sizeof(line), baseline)) {
+		*instructions = -1;
+
+		if ('#' != line[0] &&
+		    2 <= sscanf(line, "%31s %lf %lf", entry,
+				ns_per_byte, instructions) &&
+		    0 == strcmp(entry, name))
+			return (0 < *ns_per_byte) ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  usage
+*/
+
+static void
+usage(int exit_code)
+{
+	fprintf(stderr,
+		"Usage\n"
+		"\tbench [-baseline FILE [-tolerance PERCENT]] [-save FILE]"
+		" [NAME ...]\n"
+		"\t-h : display this help message\n"
+		"\t-baseline FILE : compare with FILE, exit 1 on a regression\n"
+		"\t-tolerance PERCENT : allowed slow down in time, %d by default\n"
+		"\t-save FILE : write the results as a new baseline\n"
+		"\tNAME : only run benchmarks starting with NAME\n",
+		TIME_TOLERANCE);
+	exit(exit_code);
+}
+
+/*
+  ==============================================================================
+  Public
+  ==============================================================================
+*/
+
+/*
+  ------------------------------------------------------------------------------
+  main
+*/
+
+int
+main(int argc, char *argv[])
+{
+	int long_option = 0;
+	int option;
+	const char *baseline_path = NULL;
+	const char *save_path = NULL;
+	double tolerance = TIME_TOLERANCE;
+	FILE *baseline = NULL;
+	FILE *save = NULL;
+	unsigned char *crc_buffer = NULL;
+	benchmark_t *benchmark;
+	cpu_set_t cpus;
+	double base;
+	double base_instructions;
+	double change;
+	int regressions = 0;
+	int selected;
+	int based;
+	int regressed;
+	int attempt;
+	int index;
+	int return_value = EXIT_FAILURE;
+
+	struct option long_options[] = {
+		{"help", no_argument, &long_option, 'H'},
+		{"baseline", required_argument, &long_option, 'B'},
+		{"tolerance", required_argument, &long_option, 'T'},
+		{"save", required_argument, &long_option, 'S'},
+		{0, 0, 0, 0}
+	};
+
+	while (-1 != (option =
+		      getopt_long_only(argc, argv, "",
+				       long_options, NULL))) {
+		if (0 != option)
+			usage(EXIT_FAILURE);
+
+		switch (long_option) {
+		case 'H':
+			usage(EXIT_SUCCESS);
+			break;
+
+		case 'B':
+			baseline_path = optarg;
+			break;
+
+		case 'T':
+			tolerance = atof(optarg);
+			break;
+
+		case 'S':
+			save_path = optarg;
+			break;
+
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (NULL != baseline_path &&
+	    NULL == (baseline = fopen(baseline_path, "r"))) {
+		fprintf(stderr, "Error opening %s: %s\n",
+			baseline_path, strerror(errno));
+		goto cleanup;
+	}
+
+	if (NULL != save_path && NULL == (save = fopen(save_path, "w"))) {
+		fprintf(stderr, "Error opening %s: %s\n",
+			save_path, strerror(errno));
+		goto cleanup;
+	}
+
+	if (NULL == (null_ = fopen("/dev/null", "w"))) {
+		fprintf(stderr, "Error opening /dev/null: %s\n",
+			strerror(errno));
+		goto cleanup;
+	}
+
+	/* stay on one processor, so the caches and counters are its own */
+	CPU_ZERO(&cpus);
+	CPU_SET(sched_getcpu(), &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+
+	if (NULL == (crc_buffer = malloc(0x100000 + 64))) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto cleanup;
+	}
+
+	fill_random(crc_buffer, 0x100000 + 64, 0x1234abcd);
+
+	if (0 != setup(crc_buffer)) {
+		fprintf(stderr, "Unable to set up the benchmarks\n");
+		goto cleanup;
+	}
+
+	perf_open();
+
+	if (0 > perf_fd_)
+		fprintf(stderr, "No hardware counters: %s\n", strerror(errno));
+
+	if (NULL != save)
+		fprintf(save,
+			"# benchmark ns/byte instructions/byte (- if not counted)\n"
+			"# fastest of %d runs, compared by instructions when both"
+			" have them\n"
+			"# Record a new one for another machine:"
+			" make bench BENCH_FLAGS=-save=bench.baseline\n", RUNS);
+
+	printf("%-20s %10s %10s %10s %10s %10s %8s\n", "benchmark",
+	       "ns/byte", "cycles/B", "instr/B", "miss/KB", "baseline",
+	       "change");
+
+	for (benchmark = benchmarks_;
+	     benchmark < &benchmarks_[benchmark_count_]; ++benchmark) {
+		selected = (optind >= argc);
+
+		for (index = optind; index < argc; ++index)
+			if (0 == strncmp(benchmark->name, argv[index],
+					 strlen(argv[index])))
+				selected = 1;
+
+		if (!selected)
+			continue;
+
+		based = (0 == baseline_get(baseline, benchmark->name,
+					   &base, &base_instructions));
+
+		for (attempt = 0; attempt < ATTEMPTS; ++attempt) {
+			if (0 != attempt)
+				usleep(ATTEMPT_PAUSE);
+
+			measure(benchmark);
+
+			if (NULL == save &&
+			    (!based || 0 == compare(benchmark, base,
+						    base_instructions,
+						    tolerance, &change)))
+				break;
+		}
+
+		printf("%-20s %10.3f", benchmark->name, benchmark->ns_per_byte);
+		print_counter(benchmark->counters[0], 1);
+		print_counter(benchmark->counters[1], 1);
+		print_counter(benchmark->counters[2], 1024);
+
+		if (NULL != save) {
+			fprintf(save, "%s %.4f", benchmark->name,
+				benchmark->ns_per_byte);
+
+			if (0 > benchmark->counters[1])
+				fprintf(save, " -\n");
+			else
+				fprintf(save, " %.4f\n", benchmark->counters[1]);
+		}
+
+		if (!based) {
+			printf("\n");
+			continue;
+		}
+
+		regressed = compare(benchmark, base, base_instructions,
+				    tolerance, &change);
+
+		/* the figure compared, instructions are marked */
+		if (0 < base_instructions && 0 <= benchmark->counters[1])
+			printf(" %9.3fi %+7.1f%%", base_instructions, change);
+		else
+			printf(" %10.3f %+7.1f%%", base, change);
+
+		if (regressed) {
+			printf(" REGRESSION");
+			++regressions;
+		}
+
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (0 != regressions)
+		printf("%d regression(s), over the tolerance in time or %d%% in"
+		       " instructions\n", regressions, INSTRUCTION_TOLERANCE);
+
+	return_value = (0 == regressions) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+cleanup:
+
+	for (benchmark = benchmarks_;
+	     benchmark < &benchmarks_[benchmark_count_]; ++benchmark)
+		bspimage_close(benchmark->image);
+
+	for (index = COUNTERS - 1; 0 <= perf_fd_ && index >= 0; --index)
+		close(perf_fds_[index]);
+
+	free(crc_buffer);
+
+	if (NULL != null_)
+		fclose(null_);
+
+	if (NULL != save)
+		fclose(save);
+
+	if (NULL != baseline)
+		fclose(baseline);
+
+	return return_value;
+}
@@ -0,0 +1,1714 @@
+/*
+ * bspimage.c
+ *
+ * Copyright (C) 2014 LSI Logic
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "bspimage.h"
+#include "config.h"
+
+/*
+  ==============================================================================
+  Local
+  ==============================================================================
+*/
+
+/* u-boot environment data structure */
+typedef struct environment {
+	uint32_t crc32;
+	uint32_t flags;
+	uint32_t size;
+	void *data;
+} __attribute__ ((packed))environment_t;
+
+
+/* u-boot image data structure */
+typedef struct image_header {
+	uint32_t ih_magic;	/* Image Header Magic Number	*/
+	uint32_t ih_hcrc;	/* Image Header CRC Checksum	*/
+	uint32_t ih_time;	/* Image Creation Timestamp	*/
+	uint32_t ih_size;	/* Image Data Size		*/
+	uint32_t ih_load;	/* Data	 Load  Address		*/
+	uint32_t ih_ep;		/* Entry Point Address		*/
+	uint32_t ih_dcrc;	/* Image Data CRC Checksum	*/
+	uint32_t ih_os;		/* Operating System		*/
+	uint32_t ih_arch;	/* CPU architecture		*/
+	uint32_t ih_type;	/* Image Type			*/
+	uint32_t ih_comp;	/* Compression Type		*/
+	uint32_t ih_name[IH_NMLEN]; /* Image Name		*/
+} __attribute__((packed))uboot_header_t;
+
+/* parameter image data structure */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t checksum;
+	uint32_t version;
+	uint32_t chipType;
+	uint32_t globalOffset;
+	uint32_t globalSize;
+	uint32_t pciesrioOffset;
+	uint32_t pciesrioSize;
+	uint32_t voltageOffset;
+	uint32_t voltageSize;
+	uint32_t clocksOffset;
+	uint32_t clocksSize;
+	uint32_t systemMemoryOffset;
+	uint32_t systemMemorySize;
+	uint32_t classifierMemoryOffset;
+	uint32_t classifierMemorySize;
+	uint32_t systemMemoryRetentionOffset;
+	uint32_t systemMemoryRetentionSize;
+} __attribute__((packed)) parameter_header_t;
+
+typedef struct {
+	unsigned version;
+	unsigned flags;
+	unsigned baud_rate;
+	unsigned memory_ranges[16];
+	unsigned long sequence;
+	char description[128];
+} __attribute__((packed)) parameters_global_t;
+
+/* read buffer unit for files, which have no erase block size */
+#define BSPIMAGE_FILE_UNIT 0x10000
+
+/* how much of a streamed image is buffered before it is programmed */
+#define BSPIMAGE_STREAM_CHUNK 0x40000
+
+struct bspimage {
+    const char *type;
+    const char *asic;
+    char select;
+    mtd_device_t device;
+    mtd_reader_t reader;
+    int info_status;            /* 1 until decoded, then 0 or -1 */
+    bspimage_info_t info;
+    int verify_status;          /* 1 until checked, then 0 */
+    bspimage_verify_t verify;
+    bspimage_checksum_t checksum;
+    unsigned long env_size;     /* found by get_env_crc32(), 0 until then */
+    int env_walk;               /* the walk's shared lock is held */
+};
+
+static int
+find_version(mtd_reader_t *reader, const char *needle, char *version)
+{
+    long offset;
+    unsigned long length;
+    const char *match;
+
+    version[0] = '\0';
+
+    if (0 > (offset = reader_find(reader, 0, needle, strlen(needle))))
+        return 0;
+
+    length = reader->size - offset;
+    if (length > INPUT_BUFFER_SIZE)
+        length = INPUT_BUFFER_SIZE;
+
+    if (NULL == (match = reader_get(reader, offset, length)))
+        return -1;
+
+    length = strnlen(match, length);
+    memcpy(version, match, length);
+    version[length] = '\0';
+
+    return 0;
+}
+
+static int 
+decode_uboot(bspimage_t *image)
+{
+    const uboot_header_t *header;
+    bspimage_info_t *info = &image->info;
+
+    if (NULL == (header = reader_get(&image->reader, 0,
+                                     sizeof(uboot_header_t))))
+        return -1;
+
+    if (IH_MAGIC != ntohl(header->ih_magic)){
+        fprintf(stderr, "uboot magic number doesn't match\n");
+        fprintf(stderr, "no a valid uboot\n");
+        return -1;
+    }
+
+    info->magic = ntohl(header->ih_magic);
+    info->crc = ntohl(header->ih_hcrc);
+    info->time = ntohl(header->ih_time);
+
+    if (0 == strcmp(image->asic, "55xx"))
+        return find_version(&image->reader, UBOOT_KEY_55XX, info->version);
+
+    return find_version(&image->reader, UBOOT_KEY, info->version);
+}
+
+static int 
+decode_spl(bspimage_t *image)
+{
+    const uboot_header_t *header;
+    bspimage_info_t *info = &image->info;
+
+    /* the 55xx spl is a plain binary */
+    if (0 == strcmp(image->asic, "55xx"))
+        return find_version(&image->reader, SPL_KEY_55XX, info->version);
+
+    if (NULL == (header = reader_get(&image->reader, 0,
+                                     sizeof(uboot_header_t))))
+        return -1;
+
+    if (IH_MAGIC != ntohl(header->ih_magic)){
+        fprintf(stderr, "spl magic number doesn't match\n");
+        fprintf(stderr, "no a valid spl\n");
+        return -1;
+    }
+
+    info->magic = ntohl(header->ih_magic);
+    info->crc = ntohl(header->ih_hcrc);
+    info->time = ntohl(header->ih_time);
+
+    if (0 != find_version(&image->reader, SPL_KEY, info->version))
+        return -1;
+
+    return find_version(&image->reader, ATF_KEY, info->atf_version);
+}
+
+static int
+decode_param_section(bspimage_t *image, bspimage_section_t *section,
+                     const char *name, uint32_t offset, uint32_t size)
+{
+    const uint32_t *values;
+
+    section->name = name;
+    section->offset = offset & ~3;
+    section->size = size;
+
+    /* size is in words and includes the version */
+    if ((0 == size) ||
+        (NULL == (values = reader_get(&image->reader, section->offset,
+                                      (unsigned long)size * 4))))
+        return -1;
+
+    section->version = ntohl(*values);
+    return 0;
+}
+
+static int 
+decode_param(bspimage_t *image)
+{
+	parameter_header_t header;
+    bspimage_info_t *info = &image->info;
+    const void *data;
+
+    if (NULL == (data = reader_get(&image->reader, 0, sizeof(header))))
+        return -1;
+
+    /* sections are read through the same window, keep a copy */
+    memcpy(&header, data, sizeof(header));
+
+    if (PARAMETERS_MAGIC != ntohl(header.magic)){
+	    fprintf(stderr, "parameter magic number doesn't match\n");
+        fprintf(stderr, "no a valid parameter file\n");
+        return -1;
+    }
+
+    info->magic = ntohl(header.magic);
+    info->param_version = ntohl(header.version);
+    info->chip_type = ntohl(header.chipType);
+
+    /* classifierMemory and systemMemoryRetention aren't shown */
+    if ((0 != decode_param_section(image, &info->sections[0], "global",
+                                   ntohl(header.globalOffset),
+                                   ntohl(header.globalSize))) ||
+        (0 != decode_param_section(image, &info->sections[1], "pciesrio",
+                                   ntohl(header.pciesrioOffset),
+                                   ntohl(header.pciesrioSize))) ||
+        (0 != decode_param_section(image, &info->sections[2], "voltage",
+                                   ntohl(header.voltageOffset),
+                                   ntohl(header.voltageSize))) ||
+        (0 != decode_param_section(image, &info->sections[3], "clock",
+                                   ntohl(header.clocksOffset),
+                                   ntohl(header.clocksSize))) ||
+        (0 != decode_param_section(image, &info->sections[4], "systemMemory",
+                                   ntohl(header.systemMemoryOffset),
+                                   ntohl(header.systemMemorySize))))
+        return -1;
+
+    return 0;
+}
+
+/*
+  The sizes u-boot may be built with for the environment, smallest
+  first.  The whole partition is tried as well.
+*/
+static const unsigned long env_sizes_[] = {
+    SMALL_ENVIRONMENT_SIZE, DEFAULT_ENVIRONMENT_SIZE
+};
+
+#define ENV_CANDIDATES (sizeof(env_sizes_) / sizeof(env_sizes_[0]) + 1)
+
+/*
+  ------------------------------------------------------------------------------
+  get_env_candidates
+
+  Sets candidates to the sizes the environment may be, the largest
+  first, and returns how many there are.
+*/
+
+static unsigned int
+get_env_candidates(bspimage_t *image, unsigned long *candidates)
+{
+    unsigned int count = 0;
+    unsigned int index;
+
+    if (0 != image->env_size) {
+        candidates[count++] = image->env_size;
+    } else {
+        candidates[count++] = image->reader.size;
+
+        for (index = ENV_CANDIDATES - 1; index-- > 0;)
+            if (env_sizes_[index] < image->reader.size)
+                candidates[count++] = env_sizes_[index];
+    }
+
+    return count;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  get_env_crc32
+
+  Finds the size of the environment, the one whose crc32 matches
+  expected, and sets *crc32 to the crc32 for it.  The crc32 runs once
+  over the largest candidate size.  Its value is saved at each smaller
+  candidate size, so all the sizes are tried in a single read.  The
+  partition size is preferred, then the larger sizes.  If none match,
+  *crc32 is for the whole partition.
+
+  The size found is kept in the handle, and only that size is tried
+  while it keeps matching.
+*/
+
+static int
+get_env_crc32(bspimage_t *image, uint32_t expected, uint32_t *crc32)
+{
+    mtd_reader_t *reader = &image->reader;
+    unsigned long candidates[ENV_CANDIDATES];
+    uint32_t checkpoints[ENV_CANDIDATES];
+    const void *data;
+    unsigned long offset;
+    unsigned long length;
+    unsigned long end;
+    unsigned int count;
+    unsigned int index;
+    uint32_t crc = 0;
+
+    /* candidates[0] is the largest */
+    count = get_env_candidates(image, candidates);
+
+    /* crc32 of ENVIRONMENT_DATA_SIZE(size) bytes, a window at a time */
+    for (offset = 8; offset < candidates[0]; offset += length) {
+        end = candidates[0];
+
+        for (index = 1; index < count; ++index)
+            if (candidates[index] > offset && candidates[index] < end)
+                end = candidates[index];
+
+        length = end - offset;
+        if (length > reader->window_size)
+            length = reader->window_size;
+        if (NULL == (data = reader_get(reader, offset, length)))
+            return -1;
+        crc = update_crc32(crc, (void *)data, length);
+
+        for (index = 1; index < count; ++index)
+            if (candidates[index] == (offset + length))
+                checkpoints[index] = crc;
+    }
+    checkpoints[0] = crc;
+
+    for (index = 0; index < count; ++index)
+        if (checkpoints[index] == expected) {
+            image->env_size = candidates[index];
+            *crc32 = checkpoints[index];
+            return 0;
+        }
+
+    /* the environment was rewritten with another size */
+    if (0 != image->env_size) {
+        image->env_size = 0;
+        return get_env_crc32(image, expected, crc32);
+    }
+
+    *crc32 = checkpoints[0];
+    return 0;
+}
+
+static int 
+decode_env(bspimage_t *image)
+{
+    const char *string;
+    const void *data;
+    environment_t header;
+    bspimage_info_t *info = &image->info;
+    unsigned long offset;
+
+    if (NULL == (data = reader_get(&image->reader, 0, 2 * sizeof(uint32_t))))
+        return -1;
+    header.size = image->reader.size;
+    header.crc32 = *((uint32_t *)data);
+    header.flags = *((uint32_t *)(data + 4));
+
+    if (0 != get_env_crc32(image, header.crc32, &info->env_crc32))
+        return -1;
+
+    if (info->env_crc32 != header.crc32){
+        fprintf(stderr, "%s crc32 doesn't match\n", image->device.name);
+        fprintf(stderr, "no a valid environment file\n");
+        return -1;
+    }
+
+    info->env_size = image->env_size;
+    offset = 8;
+    while (NULL != (string = reader_string(&image->reader, offset)) &&
+           0x00 != string[0]) {
+        ++info->env_count;
+        offset += (strlen(string) + 1);
+    }
+
+    return (NULL == string) ? -1 : 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  report
+
+  Sets the verify message.
+*/
+
+static void
+report(bspimage_t *image, const char *format, ...)
+{
+    va_list arguments;
+
+    va_start(arguments, format);
+    vsnprintf(image->verify.message, sizeof(image->verify.message),
+              format, arguments);
+    va_end(arguments);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  verify_uboot_img
+
+  Checks the header and data crc32 of a legacy u-boot image (u-boot and
+  the 56xx/XLF spl).
+*/
+
+static int
+verify_uboot_img(bspimage_t *image)
+{
+    unsigned char header[IH_HEADER_SIZE];
+    mtd_reader_t *reader = &image->reader;
+    const void *data;
+    uint32_t expected;
+    uint32_t crc32 = 0;
+    unsigned long size;
+    unsigned long offset;
+    unsigned long length;
+
+    if (NULL == (data = reader_get(reader, 0, IH_HEADER_SIZE)))
+        return -1;
+    memcpy(header, data, IH_HEADER_SIZE);
+
+    if (IH_MAGIC != ntohl(((uboot_header_t *)header)->ih_magic)) {
+        report(image, "magic number doesn't match");
+        return 0;
+    }
+
+    /* the header crc32 is taken with ih_hcrc cleared */
+    expected = ntohl(((uboot_header_t *)header)->ih_hcrc);
+    ((uboot_header_t *)header)->ih_hcrc = 0;
+    if (expected != get_crc32(header, IH_HEADER_SIZE)) {
+        report(image, "header crc32 doesn't match");
+        return 0;
+    }
+
+    size = ntohl(((uboot_header_t *)header)->ih_size);
+    if (size > (reader->size - IH_HEADER_SIZE)) {
+        report(image, "data size 0x%lx is beyond the 0x%lx bytes read",
+               size, reader->size);
+        return 0;
+    }
+
+    for (offset = IH_HEADER_SIZE; offset < (IH_HEADER_SIZE + size);
+         offset += length) {
+        length = IH_HEADER_SIZE + size - offset;
+        if (length > reader->window_size)
+            length = reader->window_size;
+        if (NULL == (data = reader_get(reader, offset, length)))
+            return -1;
+        crc32 = update_crc32(crc32, (void *)data, length);
+    }
+
+    if (ntohl(((uboot_header_t *)header)->ih_dcrc) != crc32) {
+        report(image, "data crc32 doesn't match");
+        return 0;
+    }
+
+    image->verify.valid = 1;
+    report(image, "header and data crc32 ok");
+    return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  verify_param_img
+
+  The parameter checksum is the crc32 of everything after the checksum.
+*/
+
+static int
+verify_param_img(bspimage_t *image)
+{
+	parameter_header_t header;
+    mtd_reader_t *reader = &image->reader;
+    const void *data;
+    uint32_t crc32 = 0;
+    unsigned long size;
+    unsigned long offset;
+    unsigned long length;
+
+    if (NULL == (data = reader_get(reader, 0, sizeof(header))))
+        return -1;
+    memcpy(&header, data, sizeof(header));
+
+    if (PARAMETERS_MAGIC != ntohl(header.magic)) {
+        report(image, "magic number doesn't match");
+        return 0;
+    }
+
+    size = ntohl(header.size);
+    if ((size < 12) || (size > reader->size)) {
+        report(image, "size 0x%lx is not valid", size);
+        return 0;
+    }
+
+    for (offset = 12; offset < size; offset += length) {
+        length = size - offset;
+        if (length > reader->window_size)
+            length = reader->window_size;
+        if (NULL == (data = reader_get(reader, offset, length)))
+            return -1;
+        crc32 = update_crc32(crc32, (void *)data, length);
+    }
+
+    if (ntohl(header.checksum) != crc32) {
+        report(image, "checksum doesn't match");
+        return 0;
+    }
+
+    image->verify.valid = 1;
+    report(image, "checksum ok");
+    return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  verify_env_img
+*/
+
+static int
+verify_env_img(bspimage_t *image)
+{
+    const void *data;
+    uint32_t expected;
+    uint32_t crc32;
+
+    if (NULL == (data = reader_get(&image->reader, 0, sizeof(uint32_t))))
+        return -1;
+    expected = *((uint32_t *)data);
+
+    if (0 != get_env_crc32(image, expected, &crc32))
+        return -1;
+
+    if (expected != crc32) {
+        report(image, "crc32 doesn't match");
+        return 0;
+    }
+
+    image->verify.valid = 1;
+
+    if (image->env_size != image->reader.size)
+        report(image, "crc32 ok, %luK environment", image->env_size / 1024);
+    else
+        report(image, "crc32 ok");
+    return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  get_checksum
+
+  Finds what the checksum of the image covers from its header alone,
+  for bspimage_checksum().
+*/
+
+static int
+get_checksum(bspimage_t *image)
+{
+    bspimage_checksum_t *checksum = &image->checksum;
+    mtd_reader_t *reader = &image->reader;
+    unsigned char header[IH_HEADER_SIZE];
+    unsigned long candidates[ENV_CANDIDATES];
+    const void *data;
+    uint32_t expected;
+    unsigned long size;
+    unsigned int index;
+
+    memset(checksum, 0, sizeof(bspimage_checksum_t));
+
+    if ((0 == strcmp("spl", image->type)) &&
+        (0 == strcmp("55xx", image->asic)))
+        return 0;
+
+    checksum->checked = 1;
+
+    if ((0 == strcmp("uboot", image->type)) ||
+        (0 == strcmp("spl", image->type))) {
+        if (NULL == (data = reader_get(reader, 0, IH_HEADER_SIZE)))
+            return -1;
+        memcpy(header, data, IH_HEADER_SIZE);
+        expected = ntohl(((uboot_header_t *)header)->ih_hcrc);
+        ((uboot_header_t *)header)->ih_hcrc = 0;
+        size = ntohl(((uboot_header_t *)header)->ih_size);
+
+        if ((IH_MAGIC != ntohl(((uboot_header_t *)header)->ih_magic)) ||
+            (expected != get_crc32(header, IH_HEADER_SIZE)) ||
+            (size > (reader->size - IH_HEADER_SIZE)))
+            return 0;
+
+        checksum->crc32 = ntohl(((uboot_header_t *)header)->ih_dcrc);
+        checksum->offset = IH_HEADER_SIZE;
+        checksum->ends[checksum->end_count++] = IH_HEADER_SIZE + size;
+    } else if (0 == strcmp("param", image->type)) {
+        if (NULL == (data = reader_get(reader, 0, sizeof(parameter_header_t))))
+            return -1;
+        size = ntohl(((parameter_header_t *)data)->size);
+
+        if ((PARAMETERS_MAGIC != ntohl(((parameter_header_t *)data)->magic)) ||
+            (size < 12) || (size > reader->size))
+            return 0;
+
+        checksum->crc32 = ntohl(((parameter_header_t *)data)->checksum);
+        checksum->offset = 12;
+        checksum->ends[checksum->end_count++] = size;
+    } else if (0 == strcmp("env", image->type)) {
+        if (NULL == (data = reader_get(reader, 0, sizeof(uint32_t))))
+            return -1;
+
+        checksum->crc32 = *((uint32_t *)data);
+        checksum->offset = 8;
+        checksum->end_count = get_env_candidates(image, candidates);
+
+        if (checksum->end_count > BSPIMAGE_CHECKSUM_ENDS)
+            checksum->end_count = BSPIMAGE_CHECKSUM_ENDS;
+
+        for (index = 0; index < checksum->end_count; ++index)
+            checksum->ends[index] = candidates[index];
+    } else {
+        fprintf(stderr, "no header found!\n");
+        return -1;
+    }
+
+    checksum->valid = 1;
+    return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  invalidate
+
+  Forgets everything read from flash, after it has been written.
+*/
+
+static void
+invalidate(bspimage_t *image)
+{
+    /* a mapping always shows what is there now */
+    if (!image->reader.mapped) {
+        image->reader.window_offset = 0;
+        image->reader.window_length = 0;
+    }
+    image->info_status = 1;
+    image->verify_status = 1;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  attach
+
+  The read buffer is only allocated when something is read, so a handle
+  that just writes or clones leaves the arena to the buffers it needs.
+*/
+
+static int
+attach(bspimage_t *image)
+{
+    if (NULL != image->reader.window)
+        return 0;
+
+    /* files, and NOR that supports it, are used in place */
+    if ((MTD_ABSENT == image->device.info.type) ||
+        (MTD_NORFLASH == image->device.info.type))
+        return reader_map(&image->reader, image->device.fd,
+                          image->device.name, image->device.info.size,
+                          image->device.info.erasesize);
+
+    /* reads are split to stay inside the SSP timeout, see io_read() */
+    return reader_attach(&image->reader, image->device.fd, image->device.name,
+                         image->device.info.size,
+                         image->device.info.erasesize);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  try_map
+
+  Maps the partition if it can be, without keeping a read buffer if it
+  can't.
+*/
+
+static void
+try_map(bspimage_t *image)
+{
+    if (NULL != image->reader.window)
+        return;
+
+    if ((0 == attach(image)) && !image->reader.mapped)
+        reader_close(&image->reader);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  lock
+
+  Attaches the reader and takes a shared lock on the partition, so it
+  isn't read while another process writes it.  Writes are locked by
+  the mtd_*() functions.
+*/
+
+static int
+lock(bspimage_t *image)
+{
+    if (0 != attach(image))
+        return -1;
+
+    return mtd_lock(&image->device, 0);
+}
+
+static void
+unlock(bspimage_t *image)
+{
+    mtd_unlock(&image->device);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  get_buffer
+
+  Returns the read buffer if it holds at least size bytes and can be
+  written to, otherwise allocates one that the caller frees with
+  arena_free().
+*/
+
+static void *
+get_buffer(bspimage_t *image, unsigned long size, int *allocated)
+{
+    *allocated = 0;
+
+    if ((NULL != image->reader.window) && !image->reader.mapped &&
+        (image->reader.window_size >= size))
+        return image->reader.window;
+
+    *allocated = 1;
+    return arena_alloc(size);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  get_write_buffer
+
+  Returns a buffer to write through, of *size bytes: a multiple of the
+  erase block, no more than wanted if wanted holds an erase block.  Free
+  it with arena_free() if *allocated is set.
+*/
+
+static void *
+get_write_buffer(bspimage_t *image, unsigned long wanted,
+                 unsigned long *size, int *allocated)
+{
+    unsigned long erasesize = image->device.info.erasesize;
+
+    if (wanted < erasesize)
+        wanted = erasesize;
+
+    if ((NULL != image->reader.window) && !image->reader.mapped &&
+        (image->reader.window_size >= erasesize)) {
+        *size = (image->reader.window_size < wanted) ?
+            image->reader.window_size : wanted;
+        *size -= (*size % erasesize);
+        *allocated = 0;
+        return image->reader.window;
+    }
+
+    if (0 == (*size = arena_chunk(erasesize, wanted))) {
+        fprintf(stderr, "Memory arena too small for a %lu byte erase block\n",
+                erasesize);
+        return NULL;
+    }
+
+    *allocated = 1;
+    return arena_alloc(*size);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  write_file
+*/
+
+static int
+write_file(bspimage_t *image, const char *input, unsigned long *skipped,
+           mtd_write_mode_t mode)
+{
+    unsigned long size;
+    void *buffer;
+    int allocated;
+    int return_value;
+
+    if (NULL == (buffer = get_write_buffer(image, image->device.info.size,
+                                           &size, &allocated)))
+        return -1;
+
+    return_value = mtd_write(&image->device, input, buffer, size, skipped,
+                             mode);
+    invalidate(image);
+
+    if (allocated)
+        arena_free(buffer);
+
+    return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  check_uboot_data
+
+  Checks the start of a u-boot image, from a file or a stream.
+*/
+
+static int
+check_uboot_data(const void *data, unsigned long length)
+{
+    if ((length < IH_HEADER_SIZE) ||
+        (IH_MAGIC != ntohl(((const uboot_header_t *)data)->ih_magic))) {
+		fprintf(stderr, "Bad Input Magic!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  check_uboot_img
+*/
+
+static int 
+check_uboot_img(const char * input)
+{
+
+	FILE *file = NULL;
+	uboot_header_t header;
+    uint32_t return_value = 0;
+
+	if (NULL == (file = fopen(input, "rb"))) {
+		fprintf(stderr, "Error opening %s: %s\n",
+			input, strerror(errno));
+        return_value = -1;
+		goto cleanup;
+	}
+
+	/* only the header is checked, don't read the whole image */
+	if (1 != fread(&header, sizeof(header), 1, file)) {
+		fprintf(stderr, "Error reading %s: %s\n",
+			input, strerror(errno));
+        return_value = -1;
+		goto cleanup;
+	}
+
+	return_value = check_uboot_data(&header, sizeof(header));
+	
+cleanup:
+
+	if (NULL != file)
+		fclose(file);
+	
+	return return_value;
+}
+
+static int
+check_uboot_bin(const char * input)
+{
+    const char *dot = strrchr(input, '.');
+    if ((!dot) || (0 == strcmp(dot, ".bin")))
+        return 0;
+    else    
+        return -1;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  print_info
+*/
+
+static int
+print_info(FILE *output, bspimage_t *image)
+{
+    const bspimage_info_t *info;
+    const uint32_t *ptr;
+    const char *string;
+    unsigned long offset = 0;
+    int section;
+    uint32_t i;
+
+    if (NULL == (info = bspimage_info(image)))
+        return -1;
+
+    if ((0 == strcmp("uboot", image->type)) ||
+        (0 == strcmp("spl", image->type))) {
+        if (0 != info->magic) {
+            fprintf(output, "\tmagic number = 0x%x\n", info->magic);
+            fprintf(output, "\tcrc = 0x%x\n", info->crc);
+            fprintf(output, "\ttime = 0x%x\n", info->time);
+        }
+
+        if (0 == strcmp("uboot", image->type)) {
+            if ('\0' != info->version[0])
+                fprintf(output, "\tuboot version=%s\n", info->version);
+        } else if (0 == strcmp("55xx", image->asic)) {
+            if ('\0' != info->version[0])
+                fprintf(output, "\tSPL version=%s\n", info->version);
+        } else {
+            if ('\0' != info->version[0])
+                fprintf(output, "\tspl version=%s\n", info->version);
+            if ('\0' != info->atf_version[0])
+                fprintf(output, "\tatf version=%s\n", info->atf_version);
+        }
+    } else if (0 == strcmp("param", image->type)) {
+        fprintf(output, "\tversion = 0x%x\n", info->param_version);
+        fprintf(output, "\tchipType = 0x%x\n", info->chip_type);
+
+        for (section = 0; section < BSPIMAGE_PARAM_SECTIONS; ++section) {
+            if (NULL == (ptr = bspimage_param_values(image,
+                                                     &info->sections[section])))
+                return -1;
+
+            if (0 != section)
+                fprintf(output, "\n\n");
+
+            fprintf(output, "\t%s setting, version %d\n",
+                    info->sections[section].name, ntohl(*ptr));
+            ptr++;
+            for (i=0; i<(info->sections[section].size-1); i++)
+            {
+                if (0 ==(i%4))
+                    fprintf(output, "\t\t");
+                fprintf(output, "0x%08x    ",ntohl(*ptr));
+                if (0 ==((i+1)%4))
+                    fprintf(output, "\n");
+                ptr++;
+            }
+        }
+        fprintf(output, "\n");
+    } else if (0 == strcmp("env", image->type)) {
+        while (NULL != (string = bspimage_env_next(image, &offset)))
+            fprintf(output, "%s\n", string);
+    }
+
+    return 0;
+}
+
+/*
+  ==============================================================================
+  Public
+  ==============================================================================
+*/
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_location
+*/
+
+const char *
+bspimage_location(const char *type, const char *asic, char select)
+{
+    /* u-boot */
+    if ((0 == strcmp(type, "uboot")) &&  (0 == strcmp(asic, "55xx"))) 
+        return ('A' == select) ? UBOOT_A_55XX : UBOOT_B_55XX;
+    else if ((0 == strcmp(type, "uboot")) &&  (0 == strcmp(asic, "56xx"))) 
+        return ('A' == select) ? UBOOT_A_56XX : UBOOT_B_56XX;
+    else if ((0 == strcmp(type, "uboot")) &&  (0 == strcmp(asic, "xlf"))) 
+        return ('A' == select) ? UBOOT_A_XLF : UBOOT_B_XLF;
+
+    /* spl, there is no bank B on 55xx */
+    else if ((0 == strcmp(type, "spl")) &&  (0 == strcmp(asic, "55xx"))) 
+        return ('A' == select) ? SPL_A_55XX : NULL;
+    else if ((0 == strcmp(type, "spl")) &&  (0 == strcmp(asic, "56xx"))) 
+        return ('A' == select) ? SPL_A_56XX : SPL_B_56XX;
+    else if ((0 == strcmp(type, "spl")) &&  (0 == strcmp(asic, "xlf"))) 
+        return ('A' == select) ? SPL_A_XLF : SPL_B_XLF;
+
+    /* param */
+    else if ((0 == strcmp(type, "param")) &&  (0 == strcmp(asic, "55xx"))) 
+        return ('A' == select) ? PARAM_A_55XX : PARAM_B_55XX;
+    else if ((0 == strcmp(type, "param")) &&  (0 == strcmp(asic, "56xx"))) 
+        return ('A' == select) ? PARAM_A_56XX : PARAM_B_56XX;
+    else if ((0 == strcmp(type, "param")) &&  (0 == strcmp(asic, "xlf"))) 
+        return ('A' == select) ? PARAM_A_XLF : PARAM_B_XLF;
+
+    /* env */
+    else if ((0 == strcmp(type, "env")) &&  (0 == strcmp(asic, "55xx"))) 
+        return ('A' == select) ? ENV_A_55XX : ENV_B_55XX;
+    else if ((0 == strcmp(type, "env")) &&  (0 == strcmp(asic, "56xx"))) 
+        return ('A' == select) ? ENV_A_56XX : ENV_B_56XX;
+    else if ((0 == strcmp(type, "env")) &&  (0 == strcmp(asic, "xlf"))) 
+        return ('A' == select) ? ENV_A_XLF : ENV_B_XLF;
+
+    return NULL;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_check_file
+
+  Checks that input looks like an image of the given type before it is
+  written.
+*/
+
+int 
+bspimage_check_file(const char *type, const char *asic, const char *input)
+{
+    if((0 == strcmp(asic,"55xx")) && (0 == strcmp(type,"spl")))
+        return check_uboot_bin(input);
+    else if ((0 == strcmp(type,"uboot")) || (0 == strcmp(type,"spl")))
+		return check_uboot_img(input);
+    else
+        return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_open
+
+  Opens bank select of a type image, flags as for open(2): O_RDONLY is
+  enough unless the handle will write.
+*/
+
+bspimage_t *
+bspimage_open(const char *type, const char *asic, char select, int flags)
+{
+    bspimage_t *image;
+    const char *location;
+
+    if (NULL == (location = bspimage_location(type, asic, select))) {
+        fprintf(stderr, "No bank %c exists for %s image on %s hardware\n",
+                select, type, asic);
+        return NULL;
+    }
+
+    /* only buffers come from the arena, not the bookkeeping */
+    if (NULL == (image = malloc(sizeof(bspimage_t)))) {
+        fprintf(stderr, "Unable to allocate a handle for %s\n", location);
+        return NULL;
+    }
+
+    memset(image, 0, sizeof(bspimage_t));
+    image->type = type;
+    image->asic = asic;
+    image->select = select;
+    invalidate(image);
+
+    if (0 != mtd_open(&image->device, location, flags)) {
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_open_file
+
+  Opens an image file, or a dump of a partition, read only.  It can be
+  read and verified like a partition but not written.
+*/
+
+bspimage_t *
+bspimage_open_file(const char *type, const char *asic, const char *path)
+{
+    bspimage_t *image;
+    struct stat file_stat;
+
+    if (NULL == (image = malloc(sizeof(bspimage_t)))) {
+        fprintf(stderr, "Unable to allocate a handle for %s\n", path);
+        return NULL;
+    }
+
+    memset(image, 0, sizeof(bspimage_t));
+    image->type = type;
+    image->asic = asic;
+    image->select = '-';
+    invalidate(image);
+    image->device.name = path;
+
+    if (0 > (image->device.fd = open(path, O_RDONLY))) {
+        fprintf(stderr, "Unable to open %s : %s\n", path, strerror(errno));
+        free(image);
+        return NULL;
+    }
+
+    if (0 != fstat(image->device.fd, &file_stat)) {
+        fprintf(stderr, "Unable to stat %s : %s\n", path, strerror(errno));
+        mtd_close(&image->device);
+        free(image);
+        return NULL;
+    }
+
+    if (0 == file_stat.st_size) {
+        fprintf(stderr, "%s is empty\n", path);
+        mtd_close(&image->device);
+        free(image);
+        return NULL;
+    }
+
+    /* a file has no erase blocks, the unit only sizes the read buffer */
+    image->device.info.type = MTD_ABSENT;
+    image->device.info.size = file_stat.st_size;
+    image->device.info.erasesize = BSPIMAGE_FILE_UNIT;
+
+    if (image->device.info.size < BSPIMAGE_FILE_UNIT)
+        image->device.info.erasesize = image->device.info.size;
+
+    return image;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_close
+*/
+
+void
+bspimage_close(bspimage_t *image)
+{
+    if (NULL == image)
+        return;
+
+    bspimage_env_end(image);
+    reader_close(&image->reader);
+    mtd_close(&image->device);
+    free(image);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_device
+*/
+
+const mtd_device_t *
+bspimage_device(bspimage_t *image)
+{
+    return &image->device;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_refresh
+
+  Forgets what was read, for when the partition was written through
+  another handle or process.
+*/
+
+void
+bspimage_refresh(bspimage_t *image)
+{
+    invalidate(image);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_release
+
+  Frees the read buffer, so handles kept open can take turns with an
+  arena.  Decoded info and verify results are kept.
+*/
+
+void
+bspimage_release(bspimage_t *image)
+{
+    /* the reader doesn't own the fd, so this only frees the window */
+    reader_close(&image->reader);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_info
+
+  Decodes the image header, once, returning NULL if it isn't valid.
+*/
+
+const bspimage_info_t *
+bspimage_info(bspimage_t *image)
+{
+    if (0 != lock(image))
+        return NULL;
+
+    if (1 == image->info_status) {
+        memset(&image->info, 0, sizeof(bspimage_info_t));
+
+        if (0 == strcmp("uboot", image->type))
+            image->info_status = decode_uboot(image);
+        else if (0 == strcmp("spl", image->type))
+            image->info_status = decode_spl(image);
+        else if (0 == strcmp("param", image->type))
+            image->info_status = decode_param(image);
+        else if (0 == strcmp("env", image->type))
+            image->info_status = decode_env(image);
+        else {
+            fprintf(stderr, "no header found!\n");
+            image->info_status = -1;
+        }
+    }
+
+    unlock(image);
+    return (0 == image->info_status) ? &image->info : NULL;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_param_values
+
+  Returns the big endian words of a parameter section, the version first.
+*/
+
+const uint32_t *
+bspimage_param_values(bspimage_t *image, const bspimage_section_t *section)
+{
+    const uint32_t *values;
+
+    if (0 != lock(image))
+        return NULL;
+
+    values = reader_get(&image->reader, section->offset,
+                        (unsigned long)section->size * 4);
+    unlock(image);
+    return values;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_env_next
+
+  Returns the environment variable at *offset and moves *offset on to the
+  next one, NULL after the last.  Start with *offset = 0.
+
+  The shared lock is taken by the first call and held until the walk
+  returns NULL, so a walk is of one version of the env and costs one
+  flock(), not one per variable.  Call bspimage_env_end() to stop a walk
+  early, or the lock is held until the handle is closed.
+*/
+
+const char *
+bspimage_env_next(bspimage_t *image, unsigned long *offset)
+{
+    const char *string;
+
+    if (!image->env_walk) {
+        if (0 != lock(image))
+            return NULL;
+
+        image->env_walk = 1;
+    }
+
+    if (0 == *offset)
+        *offset = 8;
+
+    string = reader_string(&image->reader, *offset);
+
+    if (NULL == string || 0x00 == string[0]) {
+        bspimage_env_end(image);
+        return NULL;
+    }
+
+    *offset += (strlen(string) + 1);
+    return string;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_env_end
+
+  Ends a walk of bspimage_env_next() before it returned NULL.
+*/
+
+void
+bspimage_env_end(bspimage_t *image)
+{
+    if (!image->env_walk)
+        return;
+
+    image->env_walk = 0;
+    unlock(image);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_env_get
+
+  Returns the value of the environment variable name, or NULL.
+*/
+
+const char *
+bspimage_env_get(bspimage_t *image, const char *name)
+{
+    unsigned long offset = 0;
+    size_t length = strlen(name);
+    const char *string;
+
+    if (NULL != bspimage_info(image))
+        while (NULL != (string = bspimage_env_next(image, &offset)))
+            if ((0 == strncmp(string, name, length)) && ('=' == string[length])) {
+                bspimage_env_end(image);
+                return string + length + 1;
+            }
+
+    return NULL;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_verify
+*/
+
+const bspimage_verify_t *
+bspimage_verify(bspimage_t *image)
+{
+    int status;
+
+    if (1 != image->verify_status)
+        return &image->verify;
+
+    if (0 != lock(image))
+        return NULL;
+
+    memset(&image->verify, 0, sizeof(bspimage_verify_t));
+    image->verify.checked = 1;
+
+    if ((0 == strcmp("spl", image->type)) &&
+        (0 == strcmp("55xx", image->asic))) {
+        image->verify.checked = 0;
+        image->verify.valid = 1;
+        report(image, "no checksum in a 55xx spl");
+        status = 0;
+    }
+    else if ((0 == strcmp("uboot", image->type)) ||
+             (0 == strcmp("spl", image->type)))
+        status = verify_uboot_img(image);
+    else if (0 == strcmp("param", image->type))
+        status = verify_param_img(image);
+    else if (0 == strcmp("env", image->type))
+        status = verify_env_img(image);
+    else {
+        fprintf(stderr, "no header found!\n");
+        status = -1;
+    }
+
+    unlock(image);
+
+    if (0 != status)
+        return NULL;
+
+    image->verify_status = 0;
+    return &image->verify;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_checksum
+
+  Returns what the checksum of the image covers, so it can be checked a
+  piece at a time as the partition is read some other way.  Only the
+  header is read.
+*/
+
+const bspimage_checksum_t *
+bspimage_checksum(bspimage_t *image)
+{
+    int status;
+
+    if (0 != lock(image))
+        return NULL;
+
+    status = get_checksum(image);
+    unlock(image);
+
+    return (0 == status) ? &image->checksum : NULL;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_read
+
+  Returns length bytes at offset, valid until the next call on image.
+*/
+
+const void *
+bspimage_read(bspimage_t *image, unsigned long offset, unsigned long length)
+{
+    const void *data;
+
+    if (0 != lock(image))
+        return NULL;
+
+    data = reader_get(&image->reader, offset, length);
+    unlock(image);
+    return data;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_write
+
+  Erases the partition and writes input to it, through the read buffer
+  if there is one.  skipped, if not NULL, is set to the number of blank
+  pages that didn't need programming.
+*/
+
+int
+bspimage_write(bspimage_t *image, const char *input, unsigned long *skipped)
+{
+    return write_file(image, input, skipped, MTD_WRITE_PLAIN);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_write_journaled
+
+  Like bspimage_write(), but each erase block is read back and the
+  progress journaled, so an interrupted write can be finished by
+  bspimage_resume().
+*/
+
+int
+bspimage_write_journaled(bspimage_t *image, const char *input,
+                         unsigned long *skipped)
+{
+    return write_file(image, input, skipped, MTD_WRITE_JOURNAL);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_resume
+
+  Like bspimage_write_journaled(), but if a journaled write of the same
+  input to the partition was interrupted, and the erase blocks it had
+  finished still hold it, only the rest is written.
+*/
+
+int
+bspimage_resume(bspimage_t *image, const char *input, unsigned long *skipped)
+{
+    return write_file(image, input, skipped, MTD_WRITE_RESUME);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_write_stream
+
+  Reads an update bundle (see bspimage_bundle_t) from input and writes
+  its image as it arrives, without staging it anywhere.  The start of
+  the image is checked as "image -w" checks a file before anything is
+  erased.  The image crc32 can only be checked once it has all arrived,
+  so the first erase block, with the header, is held back until then,
+  and left erased if it doesn't match.  skipped is as for
+  bspimage_write().
+*/
+
+int
+bspimage_write_stream(bspimage_t *image, FILE *input, unsigned long *skipped)
+{
+    bspimage_bundle_t bundle;
+    int (*check)(const void *, unsigned long) = NULL;
+    unsigned long erasesize = image->device.info.erasesize;
+    unsigned long size;
+    void *buffer;
+    int allocated;
+    int return_value;
+
+    if (1 != fread(&bundle, sizeof(bundle), 1, input)) {
+        fprintf(stderr, "Error reading the bundle header\n");
+        return -1;
+    }
+
+    if (BSPIMAGE_BUNDLE_MAGIC != ntohl(bundle.magic)) {
+        fprintf(stderr, "Not an update bundle\n");
+        return -1;
+    }
+
+    if (ntohl(bundle.hcrc) !=
+        get_crc32(&bundle, offsetof(bspimage_bundle_t, hcrc))) {
+        fprintf(stderr, "Bundle header crc32 doesn't match\n");
+        return -1;
+    }
+
+    if (0 != strncmp(bundle.type, image->type, sizeof(bundle.type))) {
+        fprintf(stderr, "Bundle holds a %.*s image, not %s\n",
+                (int)sizeof(bundle.type), bundle.type, image->type);
+        return -1;
+    }
+
+    if ((0 == strcmp(image->type, "uboot")) ||
+        ((0 == strcmp(image->type, "spl")) && (0 != strcmp(image->asic, "55xx"))))
+        check = check_uboot_data;
+
+    /*
+      Small chunks, so programming keeps up with the data arriving, and
+      an erase block before them to hold the first one back in.
+    */
+    if (NULL == (buffer = get_write_buffer(image,
+                                           erasesize + BSPIMAGE_STREAM_CHUNK,
+                                           &size, &allocated)))
+        return -1;
+
+    if (size < (2 * erasesize)) {
+        fprintf(stderr, "Memory arena too small for two %lu byte erase "
+                "blocks\n", erasesize);
+        return_value = -1;
+    } else {
+        return_value = mtd_write_stream(&image->device, input,
+                                        ntohl(bundle.size),
+                                        buffer + erasesize, size - erasesize,
+                                        buffer, check, ntohl(bundle.crc32),
+                                        skipped);
+    }
+
+    invalidate(image);
+
+    if (allocated)
+        arena_free(buffer);
+
+    return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_bundle
+
+  Writes input to output as an update bundle for a type image.
+*/
+
+int
+bspimage_bundle(FILE *output, const char *type, const char *input)
+{
+    bspimage_bundle_t bundle;
+    FILE *file = NULL;
+    unsigned long size;
+    unsigned long length;
+    unsigned long total = 0;
+    uint32_t crc = 0;
+    void *buffer = NULL;
+    int pass;
+    int return_value = -1;
+
+    size = arena_chunk(1, BSPIMAGE_FILE_UNIT);
+
+    if ((0 == size) || (NULL == (buffer = arena_alloc(size))))
+        goto cleanup;
+
+    if (NULL == (file = fopen(input, "rb"))) {
+		fprintf(stderr, "Error opening %s: %s\n",
+			input, strerror(errno));
+        goto cleanup;
+    }
+
+    /* the header needs the size and crc32, so the file is read twice */
+    for (pass = 0; pass < 2; ++pass) {
+        if (1 == pass) {
+            memset(&bundle, 0, sizeof(bundle));
+            bundle.magic = htonl(BSPIMAGE_BUNDLE_MAGIC);
+            strncpy(bundle.type, type, sizeof(bundle.type));
+            bundle.size = htonl(total);
+            bundle.crc32 = htonl(crc);
+            bundle.hcrc = htonl(get_crc32(&bundle,
+                                          offsetof(bspimage_bundle_t, hcrc)));
+
+            if (1 != fwrite(&bundle, sizeof(bundle), 1, output))
+                goto write_error;
+
+            rewind(file);
+        }
+
+        while (0 < (length = fread(buffer, 1, size, file))) {
+            if (0 == pass) {
+                crc = update_crc32(crc, buffer, length);
+                total += length;
+            } else if (length != fwrite(buffer, 1, length, output)) {
+                goto write_error;
+            }
+        }
+
+        if (ferror(file)) {
+            fprintf(stderr, "Error reading %s: %s\n",
+                    input, strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    if (0 != fflush(output))
+        goto write_error;
+
+    return_value = 0;
+    goto cleanup;
+
+write_error:
+
+    fprintf(stderr, "Error writing the bundle: %s\n", strerror(errno));
+
+cleanup:
+
+    if (NULL != file)
+        fclose(file);
+
+    if (NULL != buffer)
+        arena_free(buffer);
+
+    return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_clone
+
+  Copies source onto image, see mtd_clone().
+*/
+
+int
+bspimage_clone(bspimage_t *image, bspimage_t *source,
+               unsigned long *skipped, uint32_t *crc)
+{
+    unsigned long size = image->device.info.erasesize;
+    void *device_block = NULL;
+    void *source_block = NULL;
+    int device_allocated = 0;
+    int source_allocated = 0;
+    int return_value = -1;
+
+    /* mapped partitions are compared in place, without block buffers */
+    try_map(source);
+    try_map(image);
+
+    if ((!source->reader.mapped &&
+         NULL == (source_block = get_buffer(source, size, &source_allocated))) ||
+        (!image->reader.mapped &&
+         NULL == (device_block = get_buffer(image, size, &device_allocated))))
+        goto cleanup;
+
+    return_value = mtd_clone(&image->device, &source->device,
+                             device_block, source_block,
+                             image->reader.mapped ? image->reader.window : NULL,
+                             source->reader.mapped ? source->reader.window : NULL,
+                             skipped, crc);
+    invalidate(image);
+    invalidate(source);
+
+cleanup:
+
+    /* in the reverse of the order they were allocated */
+    if (device_allocated && NULL != device_block)
+        arena_free(device_block);
+
+    if (source_allocated && NULL != source_block)
+        arena_free(source_block);
+
+    return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_print_info
+
+  Prints the info of an image the way "image -i" shows it, with the
+  partition locked throughout.
+*/
+
+int
+bspimage_print_info(FILE *output, bspimage_t *image)
+{
+    int return_value;
+
+    if (0 != lock(image))
+        return -1;
+
+    return_value = print_info(output, image);
+    unlock(image);
+
+    return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  bspimage_print_verify
+*/
+
+int
+bspimage_print_verify(FILE *output, bspimage_t *image)
+{
+    const bspimage_verify_t *verify;
+
+    if (NULL == (verify = bspimage_verify(image)))
+        return -1;
+
+    fprintf(output, "\t%s\n", verify->message);
+
+    return verify->valid ? 0 : -1;
+}
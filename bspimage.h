@@ -0,0 +1,151 @@
+/*
+ * bspimage.h
+ *
+ * Copyright (C) 2014 LSI Logic
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+  libbspimage
+
+  A bspimage_t handle opens one boot image partition (uboot, spl, param
+  or env, bank A or B) and keeps its fd, geometry and read buffer until
+  it is closed, so any number of info, read, verify and write calls can
+  be made on it without re-opening or allocating.  Results are returned
+  in structures owned by the handle, valid until the next call on it.
+  Decoded info and verify results are kept until the handle writes, or
+  until bspimage_refresh() if the partition is written some other way.
+
+  Errors are reported on stderr and as a NULL or non-zero return.  The
+  read buffer is allocated on the first read and kept until the handle
+  is closed or bspimage_release() is called.  Image files, and NOR
+  partitions that allow it, are mmap()ed and read in place instead.
+  When an arena is used (see arena_init()), buffers must be released in
+  the reverse of the order they were allocated.
+*/
+
+#ifndef __BSPIMAGE__H__
+#define __BSPIMAGE__H__
+
+#include "util.h"
+
+#define BSPIMAGE_STRING_LENGTH  257	/* INPUT_BUFFER_SIZE and the NUL */
+#define BSPIMAGE_PARAM_SECTIONS 5
+
+typedef struct bspimage bspimage_t;
+
+/*
+  An update bundle is this header, in network byte order, followed by
+  size bytes of image, so an image can be streamed to bspimage_write_stream().
+  hcrc is the crc32 of the header fields before it.
+*/
+
+#define BSPIMAGE_BUNDLE_MAGIC 0x42535042	/* "BSPB" */
+
+typedef struct bspimage_bundle {
+	uint32_t magic;
+	char type[8];		/* uboot, spl, param or env, NUL padded */
+	uint32_t size;
+	uint32_t crc32;		/* of the image */
+	uint32_t hcrc;
+} __attribute__((packed)) bspimage_bundle_t;
+
+typedef struct bspimage_section {
+	const char *name;
+	uint32_t offset;	/* in bytes */
+	uint32_t size;		/* in words, including the version */
+	uint32_t version;
+} bspimage_section_t;
+
+typedef struct bspimage_info {
+	/* uboot and spl */
+	uint32_t magic;
+	uint32_t crc;
+	uint32_t time;
+	char version[BSPIMAGE_STRING_LENGTH];	/* empty if not found */
+	char atf_version[BSPIMAGE_STRING_LENGTH];
+	/* param */
+	uint32_t param_version;
+	uint32_t chip_type;
+	bspimage_section_t sections[BSPIMAGE_PARAM_SECTIONS];
+	/* env */
+	uint32_t env_crc32;
+	unsigned long env_size;		/* detected, may be less than the partition */
+	unsigned long env_count;
+} bspimage_info_t;
+
+/*
+  What the checksum of an image covers: the crc32 of the bytes from
+  offset to one of the ends should be crc32.  There are several ends
+  when the size of the environment isn't known, the largest first.
+*/
+
+#define BSPIMAGE_CHECKSUM_ENDS 3
+
+typedef struct bspimage_checksum {
+	int checked;		/* 0 if the image has no checksum */
+	int valid;		/* 0 if the header isn't */
+	uint32_t crc32;
+	unsigned long offset;
+	unsigned long ends[BSPIMAGE_CHECKSUM_ENDS];
+	unsigned int end_count;
+} bspimage_checksum_t;
+
+typedef struct bspimage_verify {
+	int checked;		/* 0 if the image has no checksum */
+	int valid;
+	char message[BSPIMAGE_STRING_LENGTH];
+} bspimage_verify_t;
+
+const char *bspimage_location(const char *type, const char *asic, char select);
+int bspimage_check_file(const char *type, const char *asic, const char *input);
+
+bspimage_t *bspimage_open(const char *type, const char *asic, char select,
+			  int flags);
+bspimage_t *bspimage_open_file(const char *type, const char *asic,
+			       const char *path);
+void bspimage_close(bspimage_t *image);
+const mtd_device_t *bspimage_device(bspimage_t *image);
+void bspimage_refresh(bspimage_t *image);
+void bspimage_release(bspimage_t *image);
+
+const bspimage_info_t *bspimage_info(bspimage_t *image);
+const uint32_t *bspimage_param_values(bspimage_t *image,
+				      const bspimage_section_t *section);
+const char *bspimage_env_next(bspimage_t *image, unsigned long *offset);
+void bspimage_env_end(bspimage_t *image);
+const char *bspimage_env_get(bspimage_t *image, const char *name);
+const bspimage_verify_t *bspimage_verify(bspimage_t *image);
+const bspimage_checksum_t *bspimage_checksum(bspimage_t *image);
+const void *bspimage_read(bspimage_t *image,
+			  unsigned long offset, unsigned long length);
+
+int bspimage_write(bspimage_t *image, const char *input,
+		   unsigned long *skipped);
+int bspimage_write_journaled(bspimage_t *image, const char *input,
+			     unsigned long *skipped);
+int bspimage_resume(bspimage_t *image, const char *input,
+		    unsigned long *skipped);
+int bspimage_write_stream(bspimage_t *image, FILE *input,
+			  unsigned long *skipped);
+int bspimage_bundle(FILE *output, const char *type, const char *input);
+int bspimage_clone(bspimage_t *image, bspimage_t *source,
+		   unsigned long *skipped, uint32_t *crc);
+
+int bspimage_print_info(FILE *output, bspimage_t *image);
+int bspimage_print_verify(FILE *output, bspimage_t *image);
+
+#endif /* __BSPIMAGE__H__ */
@@ -28,6 +28,7 @@
 #define IH_MAGIC	                0x27051956	    /* Image Magic Number		*/
 #define SBB_MAGIC                   0x53424211      /* SBB Magic Number */
 #define IH_NMLEN		            32	            /* Image Name Length		*/
+#define IH_HEADER_SIZE              64              /* Legacy Image Header Size	*/
 #define DEFAULT_ENVIRONMENT_SIZE    (256 * 1024)
 #define SMALL_ENVIRONMENT_SIZE      (128 * 1024)
 #define ENVIRONMENT_SIZE_1_2_X      DEFAULT_ENVIRONMENT_SIZE
@@ -44,3 +45,26 @@
 #define HOSTNAME_55XX  "axx-a"
 #define HOSTNAME_56XX  "axx-v"
 #define HOSTNAME_XLF   "axx-w"
+
+#define DAEMON_SOCKET  "/var/run/image.sock"
+
+/* write journals, kept across a reboot to be resumed */
+#define JOURNAL_DIRECTORY "/var/tmp"
+
+/* write generations of the partitions, emptied at boot */
+#define GENERATION_DIRECTORY "/var/run"
+
+/* seconds to wait for a partition another process is using */
+#define LOCK_WAIT      300
+
+/* nice increment of -qos-background */
+#define QOS_NICE       10
+
+/* where -scrub carries on from, kept across a reboot */
+#define SCRUB_STATE    JOURNAL_DIRECTORY "/image.scrub"
+
+/* erase blocks -scrub reads in a run, by default */
+#define SCRUB_BLOCKS   4
+
+/* bitflips corrected in one read of a block that make it degraded */
+#define SCRUB_BITFLIPS 4
@@ -0,0 +1,512 @@
+/*
+ * daemon.c
+ *
+ * Copyright (C) 2014 LSI Logic
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+  Serves info, verify, env-get and write requests on a unix socket, so
+  repeated queries are answered from memory instead of re-reading flash.
+
+  Requests are single lines, the answer is zero or more lines of output
+  followed by "OK" or "ERROR <reason>":
+
+	info uboot|spl|param|env A|B
+	verify uboot|spl|param|env A|B
+	env-get A|B NAME
+	write uboot|spl|param|env A|B FILE
+
+  The info and verify output of each image is cached until the partition
+  is written, by the daemon or by any other process, which is seen from
+  its write generation (see mtd_generation()).  Bits that rot without a
+  write are for "image -scrub" to find.  Writes hold the cache lock
+  exclusively, so they are serialized and no query reads flash part way
+  through one.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "bspimage.h"
+#include "image.h"
+#include "config.h"
+
+/*
+  ==============================================================================
+  Local
+  ==============================================================================
+*/
+
+#define IMAGE_TYPES 4
+
+/* What is known about one image, kept until it is written. */
+typedef struct cache_entry {
+	const char *type;
+	char select;
+	const char *location;
+	bspimage_t *image;	/* NULL until first used */
+	unsigned long generation;	/* of the partition when it was read */
+	char *info;		/* info output, NULL until asked for */
+	int info_status;
+	char *verify;		/* verify output, NULL until asked for */
+	int verify_status;
+	char *env_data;		/* env only, copy of info split into lines */
+	char **env;		/* env only, lines sorted by name */
+	unsigned long env_count;
+} cache_entry_t;
+
+static const char *types_[IMAGE_TYPES] = { "uboot", "spl", "param", "env" };
+static cache_entry_t cache_[IMAGE_TYPES][2];
+static const char *asic_;
+static pthread_rwlock_t cache_lock_ = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+  ------------------------------------------------------------------------------
+  find_entry
+*/
+
+static cache_entry_t *
+find_entry(const char *type, const char *bank)
+{
+	cache_entry_t *entry;
+	int index;
+
+	if (NULL == type || NULL == bank || 1 != strlen(bank) ||
+	    ('A' != toupper(*bank) && 'B' != toupper(*bank)))
+		return NULL;
+
+	for (index = 0; index < IMAGE_TYPES; ++index)
+		if (0 == strcmp(type, types_[index]))
+			break;
+
+	if (IMAGE_TYPES == index)
+		return NULL;
+
+	entry = &cache_[index][('A' == toupper(*bank)) ? 0 : 1];
+
+	/* e.g. there is no spl bank B on 55xx */
+	return (NULL == entry->location) ? NULL : entry;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  compare_env
+*/
+
+static int
+compare_env(const void *a, const void *b)
+{
+	const char *left = *(const char **)a;
+	const char *right = *(const char **)b;
+	size_t left_length = strcspn(left, "=");
+	size_t right_length = strcspn(right, "=");
+	int result;
+
+	result = strncmp(left, right,
+			 (left_length < right_length) ? left_length : right_length);
+
+	if (0 != result)
+		return result;
+
+	return (int)left_length - (int)right_length;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  index_env
+
+  Builds the sorted name index of a valid environment from its info.
+*/
+
+static int
+index_env(cache_entry_t *entry)
+{
+	char *line;
+	char *next;
+	unsigned long count = 0;
+
+	if (NULL == (entry->env_data = strdup(entry->info)))
+		return -1;
+
+	for (line = entry->env_data; '\0' != *line; ++line)
+		if ('\n' == *line)
+			++count;
+
+	if (NULL == (entry->env = calloc(count + 1, sizeof(char *))))
+		return -1;
+
+	for (line = entry->env_data; '\0' != *line; line = next) {
+		next = line + strcspn(line, "\n");
+
+		if ('\0' != *next)
+			*next++ = '\0';
+
+		entry->env[entry->env_count++] = line;
+	}
+
+	qsort(entry->env, entry->env_count, sizeof(char *), compare_env);
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  invalidate
+*/
+
+static void
+invalidate(cache_entry_t *entry)
+{
+	free(entry->info);
+	free(entry->verify);
+	free(entry->env_data);
+	free(entry->env);
+	entry->info = NULL;
+	entry->verify = NULL;
+	entry->env_data = NULL;
+	entry->env = NULL;
+	entry->env_count = 0;
+
+	if (NULL != entry->image)
+		bspimage_refresh(entry->image);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  capture
+
+  Runs an info or verify function on the cached handle, returning its
+  output.  Called with the cache lock held for writing.
+*/
+
+static char *
+capture(cache_entry_t *entry, int (*function)(FILE *, bspimage_t *),
+	int *status)
+{
+	FILE *output;
+	char *text = NULL;
+	size_t length;
+
+	if (NULL == entry->image &&
+	    NULL == (entry->image = bspimage_open(entry->type, asic_,
+						  entry->select, O_RDONLY)))
+		return NULL;
+
+	if (NULL != (output = open_memstream(&text, &length))) {
+		*status = function(output, entry->image);
+		fclose(output);
+	}
+
+	/* The text is cached, the read buffer isn't needed any more. */
+	bspimage_release(entry->image);
+
+	return text;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  lock_loaded
+
+  Returns with the cache lock held and the info (or verify) of entry
+  loaded, if that was possible.  Both are read again if the partition
+  has been written since they were, so a repeated query only takes the
+  lock for reading.
+*/
+
+static void
+lock_loaded(cache_entry_t *entry, int verify)
+{
+	unsigned long generation;
+
+	pthread_rwlock_rdlock(&cache_lock_);
+
+	if (NULL != (verify ? entry->verify : entry->info) &&
+	    entry->generation == mtd_generation(entry->location))
+		return;
+
+	pthread_rwlock_unlock(&cache_lock_);
+	pthread_rwlock_wrlock(&cache_lock_);
+
+	/* taken before the read, so a write during it is seen next time */
+	generation = mtd_generation(entry->location);
+
+	if (entry->generation != generation) {
+		invalidate(entry);
+		entry->generation = generation;
+	}
+
+	if (verify && NULL == entry->verify) {
+		entry->verify = capture(entry, bspimage_print_verify,
+					&entry->verify_status);
+	} else if (!verify && NULL == entry->info) {
+		entry->info = capture(entry, bspimage_print_info,
+				      &entry->info_status);
+
+		if (NULL != entry->info && 0 == entry->info_status &&
+		    0 == strcmp(entry->type, "env") && 0 != index_env(entry))
+			entry->info_status = -1;
+	}
+}
+
+/*
+  ------------------------------------------------------------------------------
+  answer
+*/
+
+static void
+answer(FILE *output, char *request)
+{
+	char *save;
+	char *command = strtok_r(request, " \t\r\n", &save);
+	char *type = NULL;
+	char *bank;
+	char *name;
+	char *input;
+	char **found;
+	cache_entry_t *entry;
+	bspimage_t *image;
+	int verify;
+
+	if (NULL == command) {
+		fprintf(output, "ERROR empty request\n");
+
+		return;
+	}
+
+	if (0 == strcmp(command, "env-get"))
+		type = "env";
+	else if (0 == strcmp(command, "info") ||
+		 0 == strcmp(command, "verify") ||
+		 0 == strcmp(command, "write"))
+		type = strtok_r(NULL, " \t\r\n", &save);
+	else {
+		fprintf(output, "ERROR unknown request %s\n", command);
+
+		return;
+	}
+
+	bank = strtok_r(NULL, " \t\r\n", &save);
+
+	if (NULL == (entry = find_entry(type, bank))) {
+		fprintf(output, "ERROR no such image\n");
+
+		return;
+	}
+
+	if (0 == strcmp(command, "write")) {
+		if (NULL == (input = strtok_r(NULL, " \t\r\n", &save))) {
+			fprintf(output, "ERROR no file to write\n");
+
+			return;
+		}
+
+		pthread_rwlock_wrlock(&cache_lock_);
+
+		/*
+		  Opened and closed with the lock held, so it is the last
+		  thing allocated when an arena is used.
+		*/
+		if (0 != bspimage_check_file(entry->type, asic_, input))
+			fprintf(output, "ERROR image check failed\n");
+		else if (NULL == (image = bspimage_open(entry->type, asic_,
+							entry->select, O_RDWR)))
+			fprintf(output, "ERROR unable to open %s\n",
+				entry->location);
+		else {
+			if (0 != bspimage_write(image, input, NULL))
+				fprintf(output, "ERROR write failed\n");
+			else
+				fprintf(output, "OK\n");
+
+			bspimage_close(image);
+
+			/* Even a failed write may have changed the flash. */
+			invalidate(entry);
+		}
+		pthread_rwlock_unlock(&cache_lock_);
+
+		return;
+	}
+
+	verify = (0 == strcmp(command, "verify"));
+	lock_loaded(entry, verify);
+
+	if (NULL == (verify ? entry->verify : entry->info)) {
+		fprintf(output, "ERROR unable to read %s\n", entry->location);
+	} else if (0 == strcmp(command, "env-get")) {
+		name = strtok_r(NULL, " \t\r\n", &save);
+		found = NULL;
+
+		if (0 == entry->info_status && NULL != name)
+			found = bsearch(&name, entry->env, entry->env_count,
+					sizeof(char *), compare_env);
+
+		if (0 != entry->info_status)
+			fprintf(output, "ERROR environment is not valid\n");
+		else if (NULL == found)
+			fprintf(output, "ERROR not found\n");
+		else
+			fprintf(output, "%s\nOK\n", *found);
+	} else {
+		fputs(verify ? entry->verify : entry->info, output);
+
+		if (0 == (verify ? entry->verify_status : entry->info_status))
+			fprintf(output, "OK\n");
+		else
+			fprintf(output, "ERROR %s failed\n", command);
+	}
+
+	pthread_rwlock_unlock(&cache_lock_);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  serve_client
+*/
+
+static void *
+serve_client(void *argument)
+{
+	int fd = (int)(long)argument;
+	FILE *input;
+	FILE *output = NULL;
+	char *line = NULL;
+	size_t size = 0;
+
+	if (NULL == (input = fdopen(fd, "r"))) {
+		close(fd);
+
+		return NULL;
+	}
+
+	if (0 <= (fd = dup(fd)) && NULL == (output = fdopen(fd, "w")))
+		close(fd);
+
+	while (NULL != output && 0 < getline(&line, &size, input)) {
+		answer(output, line);
+
+		if (0 != fflush(output))
+			break;
+	}
+
+	free(line);
+	fclose(input);
+
+	if (NULL != output)
+		fclose(output);
+
+	return NULL;
+}
+
+/*
+  ==============================================================================
+  Public
+  ==============================================================================
+*/
+
+/*
+  ------------------------------------------------------------------------------
+  daemon_run
+*/
+
+int
+daemon_run(const char *path, const char *asic)
+{
+	struct sockaddr_un address;
+	pthread_attr_t attributes;
+	pthread_t thread;
+	int listen_fd;
+	int client_fd;
+	int type;
+	int bank;
+
+	asic_ = asic;
+
+	for (type = 0; type < IMAGE_TYPES; ++type) {
+		for (bank = 0; bank < 2; ++bank) {
+			cache_[type][bank].type = types_[type];
+			cache_[type][bank].select = 'A' + bank;
+			cache_[type][bank].location =
+				bspimage_location(types_[type], asic,
+						  'A' + bank);
+		}
+	}
+
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+
+		return EXIT_FAILURE;
+	}
+
+	if (0 > (listen_fd = socket(AF_UNIX, SOCK_STREAM, 0))) {
+		fprintf(stderr, "Unable to create a socket : %s\n",
+			strerror(errno));
+
+		return EXIT_FAILURE;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	unlink(path);
+
+	if (0 > bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+	    0 > listen(listen_fd, 16)) {
+		fprintf(stderr, "Unable to listen on %s : %s\n",
+			path, strerror(errno));
+		close(listen_fd);
+
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+		if (0 > (client_fd = accept(listen_fd, NULL, NULL))) {
+			if (EINTR == errno || ECONNABORTED == errno)
+				continue;
+
+			fprintf(stderr, "accept() failed on %s : %s\n",
+				path, strerror(errno));
+			break;
+		}
+
+		if (0 != pthread_create(&thread, &attributes, serve_client,
+					(void *)(long)client_fd))
+			close(client_fd);
+	}
+
+	close(listen_fd);
+	unlink(path);
+
+	return EXIT_FAILURE;
+}
@@ -39,8 +39,11 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "util.h"
+#include "bspimage.h"
+#include "image.h"
 #include "config.h"
 
 /*
@@ -49,445 +52,203 @@
   ==============================================================================
 */
 
-/* u-boot environment data structure */
-typedef struct environment {
-	uint32_t crc32;
-	uint32_t flags;
-	uint32_t size;
-	void *data;
-} __attribute__ ((packed))environment_t;
-
-
-/* u-boot image data structure */
-typedef struct image_header {
-	uint32_t ih_magic;	/* Image Header Magic Number	*/
-	uint32_t ih_hcrc;	/* Image Header CRC Checksum	*/
-	uint32_t ih_time;	/* Image Creation Timestamp	*/
-	uint32_t ih_size;	/* Image Data Size		*/
-	uint32_t ih_load;	/* Data	 Load  Address		*/
-	uint32_t ih_ep;		/* Entry Point Address		*/
-	uint32_t ih_dcrc;	/* Image Data CRC Checksum	*/
-	uint32_t ih_os;		/* Operating System		*/
-	uint32_t ih_arch;	/* CPU architecture		*/
-	uint32_t ih_type;	/* Image Type			*/
-	uint32_t ih_comp;	/* Compression Type		*/
-	uint32_t ih_name[IH_NMLEN]; /* Image Name		*/
-} __attribute__((packed))uboot_header_t;
-
-/* parameter image data structure */
-
-typedef struct {
-	uint32_t magic;
-	uint32_t size;
-	uint32_t checksum;
-	uint32_t version;
-	uint32_t chipType;
-	uint32_t globalOffset;
-	uint32_t globalSize;
-	uint32_t pciesrioOffset;
-	uint32_t pciesrioSize;
-	uint32_t voltageOffset;
-	uint32_t voltageSize;
-	uint32_t clocksOffset;
-	uint32_t clocksSize;
-	uint32_t systemMemoryOffset;
-	uint32_t systemMemorySize;
-	uint32_t classifierMemoryOffset;
-	uint32_t classifierMemorySize;
-	uint32_t systemMemoryRetentionOffset;
-	uint32_t systemMemoryRetentionSize;
-} __attribute__((packed)) parameter_header_t;
-
-typedef struct {
-	unsigned version;
-	unsigned flags;
-	unsigned baud_rate;
-	unsigned memory_ranges[16];
-	unsigned long sequence;
-	char description[128];
-} __attribute__((packed)) parameters_global_t;
-
-
+/* What the command line asked for. */
 typedef struct image_dev
 {
-    const char *location; 
     const char *type; 
     const char *asic; 
     char  select;
     const char *input;
-    int (*write)(struct image_dev *); 
-    int (*delete)(struct image_dev *); 
-    int (*print_mtd_image)(struct image_dev *); 
-    int (*check_file_image)(struct image_dev *); 
+    int journal;                /* read back and journal the write */
+    int resume;                 /* continue an interrupted write */
 } image_t;
 
+/*
+  ------------------------------------------------------------------------------
+  print_mtd_image
+*/
 
-static int 
-print_uboot_info(void * data, uint32_t size, const char *asic)
-{
-    char *needle = UBOOT_KEY; 
-    void *match = NULL;
-    uboot_header_t *header = (uboot_header_t *)data;
-
-    if ((0 == strcmp(asic, "56xx")) || (0 == strcmp(asic, "xlf"))) {
-        if (IH_MAGIC != ntohl(header->ih_magic)){
-            fprintf(stderr, "uboot magic number doesn't match\n");
-            fprintf(stderr, "no a valid uboot\n");
-            return -1;
-        }
-        else {
-            printf("\tmagic number = 0x%x\n", ntohl(header->ih_magic));
-            printf("\tcrc = 0x%x\n", ntohl(header->ih_hcrc));
-            printf("\ttime = 0x%x\n", ntohl(header->ih_time));
-
-            match = memmem((const void *)header, size, 
-                    (const void *)needle, strlen(needle));
-            if (match) 
-                printf("\tuboot version=%s\n", match);
-        }
-    } else if (0 == strcmp(asic, "55xx")) {
-        if (IH_MAGIC != ntohl(header->ih_magic)){
-            fprintf(stderr, "uboot magic number doesn't match\n");
-            fprintf(stderr, "no a valid uboot\n");
-            return -1;
-        }
-        else {
-            printf("\tmagic number = 0x%x\n", ntohl(header->ih_magic));
-            printf("\tcrc = 0x%x\n", ntohl(header->ih_hcrc));
-            printf("\ttime = 0x%x\n", ntohl(header->ih_time));
-        }
-        needle = UBOOT_KEY_55XX;
-        match = memmem((const void *)header, size, 
-                (const void *)needle, strlen(needle));
-        if (match) 
-            printf("\tuboot version=%s\n", match);
-    }
-    return 0;
-}
-
-
-static int 
-check_uboot_img(const char * input)
+static int
+print_mtd_image(image_t *image)
 {
+    bspimage_t *handle;
+    int return_value;
 
-	struct stat input_stat;
-	unsigned long input_size;
-	FILE *file = NULL;
-	void *file_data = NULL;
-	uboot_header_t *header;
-    uint32_t return_value = 0;
-
-	if (0 != stat(input, &input_stat)) {
-		fprintf(stderr, "Error reading %s: %s\n",
-			input, strerror(errno));
-        return_value = -1;
-		goto cleanup;
-	}
-
-	input_size = input_stat.st_size;
-
-	if (NULL == (file = fopen(input, "rb"))) {
-		fprintf(stderr, "Error opening %s: %s\n",
-			input, strerror(errno));
-        return_value = -1;
-		goto cleanup;
-	}
-
-	file_data = malloc(input_size);
-
-	if (input_size != fread(file_data, 1, input_size, file)) {
-		fprintf(stderr, "Error reading %s: %s\n",
-			input, strerror(errno));
-        return_value = -1;
-		goto cleanup;
-	}
-
-	header = (uboot_header_t *)file_data;
+    if (NULL == (handle = bspimage_open(image->type, image->asic,
+                                        image->select, O_RDONLY)))
+        return -1;
 
-	if (IH_MAGIC != ntohl(header->ih_magic)) {
-		fprintf(stderr, "Bad Input Magic!\n");
-        return_value = -1;
-		goto cleanup;
-	}
-	
-cleanup:
+    printf("%s info on bank %c on %s:\n", image->type, image->select, image->asic);
 
-	if (NULL != file_data)
-		free(file_data);
-	
+    return_value = bspimage_print_info(stdout, handle);
+    bspimage_close(handle);
+    
 	return return_value;
 }
 
+/*
+  ------------------------------------------------------------------------------
+  verify_mtd_image
+*/
+
 static int
-check_uboot_bin(const char * input)
+verify_mtd_image(image_t *image)
 {
-    const char *dot = strrchr(input, '.');
-    if ((!dot) || (0 == strcmp(dot, ".bin")))
-        return 0;
-    else    
+    bspimage_t *handle;
+    int return_value;
+
+    if (NULL == (handle = bspimage_open(image->type, image->asic,
+                                        image->select, O_RDONLY)))
         return -1;
-}
 
-static int 
-print_spl_info(void * data, uint32_t size, const char *asic)
-{
-    char *needle = SPL_KEY; 
-    void *match = NULL;
-    uboot_header_t *header = (uboot_header_t *)data;
-
-    if (0 == strcmp(asic, "56xx") || 0 == strcmp(asic, "xlf"))
-    {
-        if (IH_MAGIC != ntohl(header->ih_magic)){
-            fprintf(stderr, "spl magic number doesn't match\n");
-            fprintf(stderr, "no a valid spl\n");
-            return -1;
-        }
-        else {
-            printf("\tmagic number = 0x%x\n", ntohl(header->ih_magic));
-            printf("\tcrc = 0x%x\n", ntohl(header->ih_hcrc));
-            printf("\ttime = 0x%x\n", ntohl(header->ih_time));
-
-            match = memmem((const void *)header, size, 
-                    (const void *)needle, strlen(needle));
-            if (match) 
-                printf("\tspl version=%s\n", match);
-            needle = ATF_KEY;
-            match = memmem((const void *)header, size, 
-                    (const void *)needle, strlen(needle));
-            if (match) 
-                printf("\tatf version=%s\n", match);
+    printf("%s on bank %c on %s:\n", image->type, image->select, image->asic);
 
-        }
-    } else if (0 == strcmp(asic, "55xx")) {
-        needle = SPL_KEY_55XX;
-        match = memmem((const void *)header, size, 
-                (const void *)needle, strlen(needle));
-        if (match) 
-            printf("\tSPL version=%s\n", match);
-    }
-    return 0;
+    return_value = bspimage_print_verify(stdout, handle);
+    bspimage_close(handle);
+    
+	return return_value;
 }
 
+/*
+  ------------------------------------------------------------------------------
+  write_mtd_image
+*/
+
 static int 
-print_param_info(void * data, uint32_t size)
+write_mtd_image(image_t *image) 
 {
-    uint32_t i;
-    uint32_t *ptr = NULL;
-	parameter_header_t *header = (parameter_header_t *)data;
-    if (PARAMETERS_MAGIC != ntohl(header->magic)){
-	    fprintf(stderr, "parameter magic number doesn't match\n");
-        fprintf(stderr, "no a valid parameter file\n");
-        return -1;
-    } else {
-        printf( "\tversion = 0x%x\n", ntohl(header->version));
-        printf( "\tchipType = 0x%x\n", ntohl(header->chipType));
-
-        printf("\tglobal setting, version %d\n",
-                ntohl(*((uint32_t *)data + ntohl(header->globalOffset)/4)));
-        ptr = (uint32_t *)data + (ntohl(header->globalOffset)/4 + 1);
-        for (i=0; i<(ntohl(header->globalSize)-1); i++)
-        {
-            if (0 ==(i%4))
-                printf("\t\t");
-            printf("0x%08x    ",ntohl(*ptr));
-            if (0 ==((i+1)%4))
-                printf("\n");
-            ptr++;
-        }
+    bspimage_t *handle;
+    unsigned long skipped;
+    int return_value;
 
-        printf("\n\n\tpciesrio setting, version %d\n",
-                ntohl(*((uint32_t *)data + ntohl(header->pciesrioOffset)/4)));
-        ptr = (uint32_t *)data + (ntohl(header->pciesrioOffset)/4 + 1);
-        for (i=0; i<(ntohl(header->pciesrioSize)-1); i++)
-        {
-            if (0 ==(i%4))
-                printf("\t\t");
-            printf("0x%08x    ",ntohl(*ptr));
-            if (0 ==((i+1)%4))
-                printf("\n");
-            ptr++;
-        }
+    if (NULL == (handle = bspimage_open(image->type, image->asic,
+                                        image->select, O_RDWR)))
+        return -1;
 
-        printf("\n\n\tvoltage setting, version %d\n",
-                ntohl(*((uint32_t *)data + ntohl(header->voltageOffset)/4)));
-        ptr = (uint32_t *)data + (ntohl(header->voltageOffset)/4 + 1);
-        for (i=0; i<(ntohl(header->voltageSize)-1); i++)
-        {
-            if (0 ==(i%4))
-                printf("\t\t");
-            printf("0x%08x    ",ntohl(*ptr));
-            if (0 ==((i+1)%4))
-                printf("\n");
-            ptr++;
-        }
+    /* "-" is an update bundle on stdin */
+    if (0 == strcmp(image->input, "-"))
+        return_value = bspimage_write_stream(handle, stdin, &skipped);
+    else if (image->resume)
+        return_value = bspimage_resume(handle, image->input, &skipped);
+    else if (image->journal)
+        return_value = bspimage_write_journaled(handle, image->input,
+                                                &skipped);
+    else
+        return_value = bspimage_write(handle, image->input, &skipped);
 
-        printf("\n\n\tclock setting, version %d\n",
-                ntohl(*((uint32_t *)data + ntohl(header->clocksOffset)/4)));
-        ptr = (uint32_t *)data + (ntohl(header->clocksOffset)/4 + 1);
-        for (i=0; i<(ntohl(header->clocksSize)-1); i++)
-        {
-            if (0 ==(i%4))
-                printf("\t\t");
-            printf("0x%08x    ",ntohl(*ptr));
-            if (0 ==((i+1)%4))
-                printf("\n");
-            ptr++;
-        }
+    if (0 == return_value)
+        printf("%s: %lu blank pages were not programmed\n",
+               bspimage_device(handle)->name, skipped);
 
+    bspimage_close(handle);
 
-        printf("\n\n\tsystemMemory setting, version %d\n",
-                ntohl(*((uint32_t *)data + ntohl(header->systemMemoryOffset)/4)));
-        ptr = (uint32_t *)data + (ntohl(header->systemMemoryOffset)/4 + 1);
-        for (i=0; i<(ntohl(header->systemMemorySize)-1); i++)
-        {
-            if (0 ==(i%4))
-                printf("\t\t");
-            printf("0x%08x    ",ntohl(*ptr));
-            if (0 ==((i+1)%4))
-                printf("\n");
-            ptr++;
-        }
-#if 0
-        printf("\tclassifier Memory setting, version %d\n",
-                ntohl(*((uint32_t *)data + ntohl(header->classifierMemoryOffset)/4)));
-        ptr = (uint32_t *)data + (ntohl(header->classifierMemoryOffset)/4 + 1);
-        for (i=0; i<(ntohl(header->classifierMemorySize)-1); i++)
-        {
-            if (0 ==(i%4))
-                printf("\t\t");
-            printf("0x%08x    ",ntohl(*ptr));
-            if (0 ==((i+1)%4))
-                printf("\n");
-            ptr++;
-        }
-
-
-        printf("\tsystem Memory Retention setting, version %d\n",
-                ntohl(*((uint32_t *)data + ntohl(header->systemMemoryRetentionOffset)/4)));
-        ptr = (uint32_t *)data + (ntohl(header->systemMemoryRetentionOffset)/4 + 1);
-        for (i=0; i<(ntohl(header->systemMemoryRetentionSize)-1); i++)
-        {
-            if (0 ==(i%4))
-                printf("\t\t");
-            printf("0x%08x    ",ntohl(*ptr));
-            if (0 ==((i+1)%4))
-                printf("\n");
-            ptr++;
-        }
-#endif 
-    }
-    printf("\n");
-    return 0;
+    return return_value;
 }
 
+/*
+  ------------------------------------------------------------------------------
+  clone_mtd_image
 
-static int 
-print_env_info(void * data, uint32_t size)
+  Copies the other bank onto the selected one.
+*/
+
+static int
+clone_mtd_image(image_t *image)
 {
-    char *string;
-    environment_t header;
-    header.size = size;
-    header.crc32 = *((uint32_t *)data);
-    header.flags = *((uint32_t *)(data + 4));
-    header.data = (uint32_t *)(data + 8);
-    uint32_t crc32 = get_crc32(header.data,
-            ENVIRONMENT_DATA_SIZE(header.size));
-    if (crc32 != header.crc32){
-        fprintf(stderr, "%s crc32 doesn't match\n");
-        fprintf(stderr, "no a valid environment file\n");
+    bspimage_t *handle;
+    bspimage_t *source;
+    unsigned long skipped;
+    uint32_t crc;
+    int return_value = -1;
+
+    if (NULL == (handle = bspimage_open(image->type, image->asic,
+                                        image->select, O_RDWR)))
         return -1;
-    } else {
-        /* print env */
-        string = header.data;
-        while (0x00 != string[0]) {
-            printf("%s\n", string);
-            string += (strlen(string) + 1);
-        }
-    }
-    return 0;
-}
 
+    if (NULL == (source = bspimage_open(image->type, image->asic,
+                                        ('A' == image->select) ? 'B' : 'A',
+                                        O_RDONLY))) {
+        bspimage_close(handle);
+        return -1;
+    }
 
+    if (0 == bspimage_clone(handle, source, &skipped, &crc)) {
+        printf("cloned %s to %s: %lu of %lu blocks already matched, crc32 0x%08x\n",
+               bspimage_device(source)->name, bspimage_device(handle)->name,
+               skipped,
+               (unsigned long)(bspimage_device(handle)->info.size /
+                               bspimage_device(handle)->info.erasesize),
+               crc);
+        return_value = 0;
+    }
 
-int
-print_mtd_image(image_t *image)
-{
-	struct mtd_info_user mtd_info;
-    void *output = NULL;
-
-	get_mtd_partition_info(image->location, &mtd_info);
-	output = malloc(mtd_info.size);
-
-    /* TODO Temporary solution to Fix a SSP timeout issue */
-#if 1
-    uint32_t reduced_size; 
-    if ((0 == strcmp(image->asic, "56xx")) || (0 == strcmp(image->asic, "xlf")))
-    {
-        reduced_size = (mtd_info.size > 0x60000) ? (reduced_size = 0x60000) :
-                        (reduced_size = mtd_info.size);
-    }else
-        reduced_size = mtd_info.size;
-                                               
-	get_mtd_partition(output, reduced_size, image->location);
-#endif 
+    /* handles are closed in the reverse of the order they were opened */
+    bspimage_close(source);
+    bspimage_close(handle);
 
-    printf("%s info on bank %c on %s:\n", image->type, image->select, image->asic);
+    return return_value;
+}
 
-    if ((0 == strcmp("spl" ,image->type)) && 
-        (0 == strcmp("55xx" ,image->asic)) &&
-        ('B' == image->select))
-        return 0; 
-    if (0 == strcmp("uboot", image->type)) {
+/*
+  ------------------------------------------------------------------------------
+  parse_size
+*/
 
-        if(0 != print_uboot_info(output, reduced_size, image->asic))
-            goto cleanup;
-    }
-    else if (0 == strcmp("spl", image->type)) {
-        if(0 != print_spl_info(output, reduced_size, image->asic))
-            goto cleanup;
-    }
-    else if (0 == strcmp("param", image->type)) {
-        if(0 != print_param_info(output, reduced_size))
-            goto cleanup;
-    }
-    else if (0 == strcmp("env", image->type)) {
-        if(0 != print_env_info(output, mtd_info.size))
-            goto cleanup;
-    }
-    else {
-	    fprintf(stderr, "no header found!\n");
-        goto cleanup;
+static unsigned long
+parse_size(const char *value)
+{
+    char *end;
+    unsigned long size = strtoul(value, &end, 0);
+
+    if ('K' == toupper(*end)) {
+        size *= 1024;
+        end++;
+    } else if ('M' == toupper(*end)) {
+        size *= 1024 * 1024;
+        end++;
     }
 
-cleanup:
-    if (NULL != output)
-        free(output);
-    
-	return 0;
+    if ((value == end) || ('\0' != *end))
+        return 0;
+
+    return size;
 }
 
+/*
+  ------------------------------------------------------------------------------
+  parse_finish
+
+  Parses +SECONDS from now, or HH:MM today, tomorrow if that has passed.
+*/
 
-int 
-image_write(image_t *image) 
+static time_t
+parse_finish(const char *value)
 {
-    const char *location = image->location; 
-    const char *input = image->input;
-    if( 0 == mtd_write(location, input))
+    time_t now = time(NULL);
+    struct tm finish;
+    char *end;
+    unsigned long seconds;
+    int hour;
+    int minute;
+
+    if ('+' == *value) {
+        seconds = strtoul(value + 1, &end, 0);
+        return (value + 1 == end || '\0' != *end) ? 0 : now + seconds;
+    }
+
+    if (2 != sscanf(value, "%d:%d", &hour, &minute) ||
+        0 > hour || 23 < hour || 0 > minute || 59 < minute)
         return 0;
-    else
-		return EXIT_FAILURE;
-}
 
+    localtime_r(&now, &finish);
+    finish.tm_hour = hour;
+    finish.tm_min = minute;
+    finish.tm_sec = 0;
 
-int 
-image_check(image_t *image) 
-{
-    if((0 == strcmp(image->asic,"55xx")) && (0 == strcmp(image->type,"spl")))
-        return check_uboot_bin(image->input);
-    else if ((0 == strcmp(image->type,"uboot")) || (0 == strcmp(image->type,"spl")))
-		return check_uboot_img(image->input);
-    else
-        return 0;
+    if (mktime(&finish) <= now)
+        ++finish.tm_mday;
+
+    return mktime(&finish);
 }
 
 /*
@@ -503,7 +264,46 @@ usage(int exit_code)
         "\timage ACTION IMAGE_TYPE [BANK_LOCATION] [FILE]\n"
 		"\t-h : display this help message\n"
 		"\t-i uboot|spl|param|env A|B : display image info\n"
-		"\t-w uboot|spl|param|env A|B file: write the image\n");
+		"\t-w uboot|spl|param|env A|B file: write the image\n"
+		"\t-w uboot|spl|param|env A|B - : write the update bundle on\n"
+		"\t\tstdin, as it arrives\n"
+		"\t-journal -w uboot|spl|param|env A|B file : read back each\n"
+		"\t\terase block and journal the write, so it can be resumed\n"
+		"\t-resume -w uboot|spl|param|env A|B file : finish an interrupted\n"
+		"\t\tjournaled write of file, from the last erase block read back\n"
+		"\t-bundle uboot|spl|param|env file : write file to stdout as an\n"
+		"\t\tupdate bundle\n"
+		"\t-scan[=csv|json] DIR 55xx|56xx|xlf [ENV_NAME ...] : decode the\n"
+		"\t\tmtdN dumps in each board sub-directory of DIR, with the\n"
+		"\t\tvalues of the ENV_NAMEs\n"
+		"\t-c uboot|spl|param|env A|B : clone the other bank onto A|B\n"
+		"\t-verify uboot|spl|param|env A|B : check the image crc32\n"
+		"\t-update MANIFEST : write the images listed in MANIFEST, one\n"
+		"\t\t\"TYPE BANK FILE\" line each, to one bank, env last\n"
+		"\t-scrub[=BLOCKS] : read the next BLOCKS erase blocks of the\n"
+		"\t\timages, %d by default, and report those that needed ECC\n"
+		"\t\tcorrections, carrying on from the last scrub\n"
+		"\t-scrub-rewrite -scrub[=BLOCKS] : and rewrite the blocks with\n"
+		"\t\tgrowing corrections\n"
+		"\t-daemon[=SOCKET] : answer info, verify, env-get and write\n"
+		"\t\trequests on SOCKET, " DAEMON_SOCKET " by default\n"
+		"\t-arena SIZE[K|M] ACTION ... : do ACTION using at most SIZE\n"
+		"\t\tbytes of buffers, a few erase blocks is enough\n"
+		"\t-lock-wait SECONDS ACTION ... : wait at most SECONDS for a\n"
+		"\t\tpartition another image is using\n"
+		"\t-qos-rate SIZE[K|M] ACTION ... : erase and program at most SIZE\n"
+		"\t\tbytes per second\n"
+		"\t-qos-duty PERCENT ACTION ... : erase and program at most\n"
+		"\t\tPERCENT of the time\n"
+		"\t-qos-finish +SECONDS|HH:MM ACTION ... : write as slowly as\n"
+		"\t\tpossible and still finish by then\n"
+		"\t-qos-background ACTION ... : lower the I/O and CPU priority\n"
+		"\t-io-deadline MILLISECONDS ACTION ... : size flash reads and\n"
+		"\t\twrites to take at most about MILLISECONDS each, 100 by\n"
+		"\t\tdefault, below the SSP timeout\n"
+		"\t-stats[=text|json] ACTION ... : time each phase of ACTION and\n"
+		"\t\tprint throughput and latency histograms on stderr\n",
+		SCRUB_BLOCKS);
 	exit(exit_code);
 }
 
@@ -531,6 +331,21 @@ main(int argc, char *argv[])
 	int selected;
 	char *device;
 	uint32_t sequence;
+	unsigned long arena = 0;
+	char stats = 0;
+	int json = 0;
+	int journal = 0;
+	int resume = 0;
+	unsigned long rate;
+	unsigned long duty;
+	unsigned long deadline;
+	time_t finish;
+	int background = 0;
+	unsigned long scrub = SCRUB_BLOCKS;
+	int rewrite = 0;
+	const char *socket_path = DAEMON_SOCKET;
+	const char *manifest = NULL;
+	int status;
     image_t image; 
 
 	struct option long_options[] = {
@@ -539,6 +354,24 @@ main(int argc, char *argv[])
 		{"info", no_argument, &long_option, 'I'},
 		{"write", no_argument, &long_option, 'W'},
 		{"file", required_argument, &long_option, 'F'},
+		{"clone", no_argument, &long_option, 'C'},
+		{"arena", required_argument, &long_option, 'A'},
+		{"stats", optional_argument, &long_option, 'S'},
+		{"verify", no_argument, &long_option, 'V'},
+		{"daemon", optional_argument, &long_option, 'Q'},
+		{"update", required_argument, &long_option, 'U'},
+		{"bundle", no_argument, &long_option, 'B'},
+		{"scan", optional_argument, &long_option, 'N'},
+		{"resume", no_argument, &long_option, 'R'},
+		{"journal", no_argument, &long_option, 'K'},
+		{"lock-wait", required_argument, &long_option, 'L'},
+		{"qos-rate", required_argument, &long_option, 'E'},
+		{"qos-duty", required_argument, &long_option, 'Y'},
+		{"qos-finish", required_argument, &long_option, 'Z'},
+		{"qos-background", no_argument, &long_option, 'G'},
+		{"io-deadline", required_argument, &long_option, 'O'},
+		{"scrub", optional_argument, &long_option, 'X'},
+		{"scrub-rewrite", no_argument, &long_option, 'J'},
 		{0, 0, 0, 0}
 	};
 
@@ -562,7 +395,119 @@ main(int argc, char *argv[])
 			case 'D':
 			case 'I':
 			case 'W':
+			case 'C':
+			case 'V':
+			case 'B':
+				action = long_option;
+				break;
+
+			case 'Q':
+				action = long_option;
+				if (NULL != optarg)
+					socket_path = optarg;
+				break;
+
+			case 'U':
+				action = long_option;
+				manifest = optarg;
+				break;
+
+			case 'R':
+				resume = 1;
+				break;
+
+			case 'K':
+				journal = 1;
+				break;
+
+			case 'L':
+				mtd_set_lock_wait(strtoul(optarg, NULL, 0));
+				break;
+
+			case 'E':
+				if (0 == (rate = parse_size(optarg))) {
+					fprintf(stderr, "Invalid rate %s\n", optarg);
+					usage(EXIT_FAILURE);
+				}
+				qos_set_rate(rate);
+				break;
+
+			case 'Y':
+				duty = strtoul(optarg, &value, 0);
+				if ((optarg == value) || ('\0' != *value) ||
+				    (0 == duty) || (100 < duty)) {
+					fprintf(stderr, "Invalid duty cycle %s\n",
+						optarg);
+					usage(EXIT_FAILURE);
+				}
+				qos_set_duty(duty);
+				break;
+
+			case 'Z':
+				if (0 == (finish = parse_finish(optarg))) {
+					fprintf(stderr, "Invalid finish time %s\n",
+						optarg);
+					usage(EXIT_FAILURE);
+				}
+				qos_set_finish(finish);
+				break;
+
+			case 'G':
+				background = 1;
+				break;
+
+			case 'O':
+				deadline = strtoul(optarg, &value, 0);
+				if ((optarg == value) || ('\0' != *value) ||
+				    (0 == deadline)) {
+					fprintf(stderr, "Invalid deadline %s\n",
+						optarg);
+					usage(EXIT_FAILURE);
+				}
+				io_set_deadline(deadline * 1000);
+				break;
+
+			case 'X':
 				action = long_option;
+				if (NULL != optarg &&
+				    (0 == (scrub = strtoul(optarg, &value, 0)) ||
+				     '\0' != *value)) {
+					fprintf(stderr, "Invalid block count %s\n",
+						optarg);
+					usage(EXIT_FAILURE);
+				}
+				break;
+
+			case 'J':
+				rewrite = 1;
+				break;
+
+			case 'N':
+				action = long_option;
+				if ((NULL == optarg) || (0 == strcmp(optarg, "csv")))
+					json = 0;
+				else if (0 == strcmp(optarg, "json"))
+					json = 1;
+				else
+					usage(EXIT_FAILURE);
+				break;
+
+			case 'A':
+				if (0 == (arena = parse_size(optarg))) {
+					fprintf(stderr, "Invalid arena size %s\n",
+						optarg);
+					usage(EXIT_FAILURE);
+				}
+				break;
+
+			case 'S':
+				if ((NULL == optarg) || (0 == strcmp(optarg, "text")))
+					stats = 't';
+				else if (0 == strcmp(optarg, "json"))
+					stats = 'j';
+				else
+					usage(EXIT_FAILURE);
+				stats_enable();
 				break;
 
 			default:
@@ -576,6 +521,53 @@ main(int argc, char *argv[])
 	/*
 	  Initialize 
 	*/
+    if ((0 != arena) && (0 != arena_init(arena)))
+        exit(EXIT_FAILURE);
+
+    if (background)
+        qos_background();
+
+    /* bundles are usually made on a build host, not a board */
+    if ('B' == action) {
+        if (2 != (argc - optind))
+            usage(EXIT_FAILURE);
+
+        if ((0 != strcmp(argv[optind], "uboot")) && (0 != strcmp(argv[optind], "spl")) &&
+            (0 != strcmp(argv[optind], "param")) && (0 != strcmp(argv[optind], "env"))) {
+            fprintf(stderr,
+                "image type should be uboot, spl, param or env!\n");
+            usage(EXIT_FAILURE);
+        }
+
+        if (0 != bspimage_bundle(stdout, argv[optind], argv[optind + 1])) {
+            fprintf(stderr, "Bundle Failed!\n");
+            return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    /* and dumps are scanned on a host, the ASIC is given */
+    if ('N' == action) {
+        if (2 > (argc - optind))
+            usage(EXIT_FAILURE);
+
+        if ((0 != strcmp(argv[optind + 1], "55xx")) &&
+            (0 != strcmp(argv[optind + 1], "56xx")) &&
+            (0 != strcmp(argv[optind + 1], "xlf"))) {
+            fprintf(stderr, "ASIC should be 55xx, 56xx or xlf!\n");
+            usage(EXIT_FAILURE);
+        }
+
+        status = scan_run(argv[optind], argv[optind + 1], json,
+                          &argv[optind + 2], argc - optind - 2);
+
+        if (0 != stats)
+            stats_print(stderr, ('j' == stats));
+
+        return (0 == status) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     if ( 0 != gethostname(&name[0], sizeof(name)))
         printf("host name = %s",(char *)&name[0]);
     if ( 0 == strncmp(HOSTNAME_55XX, &name[0], strlen(HOSTNAME_55XX)))
@@ -589,26 +581,51 @@ main(int argc, char *argv[])
         usage(EXIT_FAILURE);
     }
 
-    if ((0 == strcmp(argv[2], "uboot")) || (0 == strcmp(argv[2], "spl")) ||
-            (0 == strcmp(argv[2], "param")) || (0 == strcmp(argv[2], "env"))) {
-        image.type = argv[2];
+    if ('Q' == action)
+        return daemon_run(socket_path, image.asic);
+
+    if ('X' == action) {
+        status = scrub_run(image.asic, scrub, rewrite);
+
+        if (0 != stats)
+            stats_print(stderr, ('j' == stats));
+
+        return (0 == status) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if ('U' == action) {
+        if (0 != (status = update_run(manifest, image.asic)))
+            fprintf(stderr, "Update Failed!\n");
+
+        if (0 != stats)
+            stats_print(stderr, ('j' == stats));
+
+        return (0 == status) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (optind >= argc)
+        usage(EXIT_FAILURE);
+
+    if ((0 == strcmp(argv[optind], "uboot")) || (0 == strcmp(argv[optind], "spl")) ||
+            (0 == strcmp(argv[optind], "param")) || (0 == strcmp(argv[optind], "env"))) {
+        image.type = argv[optind];
     } else {
 	    fprintf(stderr,
 	    	"image type should be uboot, spl, param or env!\n");
 	    usage(EXIT_FAILURE);
     }
 
-    if (!argv[3])
+    if (!argv[optind + 1])
         image.select = 'A';
     else {
-        if (1 != strlen(argv[3])) {
+        if (1 != strlen(argv[optind + 1])) {
             fprintf(stderr, "Bank must be either A or B!\n");
             usage(EXIT_FAILURE);
         } else {
-            if ('A' == toupper(*(argv[3])) || 'a' == *(argv[3]) ) {
+            if ('A' == toupper(*(argv[optind + 1])) || 'a' == *(argv[optind + 1]) ) {
                 image.select = 'A';
 
-            } else if ('B' == toupper(*(argv[3])) || 'b' == *(argv[3])) {
+            } else if ('B' == toupper(*(argv[optind + 1])) || 'b' == *(argv[optind + 1])) {
                 image.select = 'B';
             } else {
                 fprintf(stderr, "Bank must be either A or B!\n");
@@ -616,51 +633,20 @@ main(int argc, char *argv[])
             }
         }
     }
-    /* u-boot */
-    if ((0 == strcmp(image.type, "uboot")) &&  (0 == strcmp(image.asic, "55xx"))) 
-        ('A' == image.select) ? (image.location = UBOOT_A_55XX) : (image.location = UBOOT_B_55XX);
-    else if ((0 == strcmp(image.type, "uboot")) &&  (0 == strcmp(image.asic, "56xx"))) 
-        ('A' == image.select) ? (image.location = UBOOT_A_56XX) : (image.location = UBOOT_B_56XX);
-    else if ((0 == strcmp(image.type, "uboot")) &&  (0 == strcmp(image.asic, "xlf"))) 
-        ('A' == image.select) ? (image.location = UBOOT_A_XLF) : (image.location = UBOOT_B_XLF);
-
-    /* spl */
-    else if ((0 == strcmp(image.type, "spl")) &&  (0 == strcmp(image.asic, "55xx"))) { 
-         if ('B' == image.select) {
-            fprintf(stderr, "No bank B exists for SPL image on 55xx hardware\n");
-	        usage(EXIT_FAILURE);
-         } else    
-            image.location = SPL_A_55XX;
+    if ((0 == strcmp(image.type, "spl")) && (0 == strcmp(image.asic, "55xx")) &&
+        ('B' == image.select)) {
+        fprintf(stderr, "No bank B exists for SPL image on 55xx hardware\n");
+        usage(EXIT_FAILURE);
     }
-    else if ((0 == strcmp(image.type, "spl")) &&  (0 == strcmp(image.asic, "56xx"))) 
-        ('A' == image.select) ? (image.location = SPL_A_56XX) : (image.location = SPL_B_56XX);
-    else if ((0 == strcmp(image.type, "spl")) &&  (0 == strcmp(image.asic, "xlf"))) 
-        ('A' == image.select) ? (image.location = SPL_A_XLF) : (image.location = SPL_B_XLF);
-
-    /* param */
-    else if ((0 == strcmp(image.type, "param")) &&  (0 == strcmp(image.asic, "55xx"))) 
-        ('A' == image.select) ? (image.location = PARAM_A_55XX) : (image.location = PARAM_B_55XX);
-    else if ((0 == strcmp(image.type, "param")) &&  (0 == strcmp(image.asic, "56xx"))) 
-        ('A' == image.select) ? (image.location = PARAM_A_56XX) : (image.location = PARAM_B_56XX);
-    else if ((0 == strcmp(image.type, "param")) &&  (0 == strcmp(image.asic, "xlf"))) 
-        ('A' == image.select) ? (image.location = PARAM_A_XLF) : (image.location = PARAM_B_XLF);
-
-    /* env */
-    else if ((0 == strcmp(image.type, "env")) &&  (0 == strcmp(image.asic, "55xx"))) 
-        ('A' == image.select) ? (image.location = ENV_A_55XX) : (image.location = ENV_B_55XX);
-    else if ((0 == strcmp(image.type, "env")) &&  (0 == strcmp(image.asic, "56xx"))) 
-        ('A' == image.select) ? (image.location = ENV_A_56XX) : (image.location = ENV_B_56XX);
-    else if ((0 == strcmp(image.type, "env")) &&  (0 == strcmp(image.asic, "xlf"))) 
-        ('A' == image.select) ? (image.location = ENV_A_XLF) : (image.location = ENV_B_XLF);
-
 
+	status = 0;
 
 	switch(action) {
 	case 'D':
 		/* TODO
 		  Delete the given name from the environment.
 
-		if (0 != ubenv_remove(argv[2]))
+		if (0 != ubenv_remove(argv[optind]))
 			fprintf(stderr, "ubenv_remove( ) failed!\n");
 		else
 			save = 1;
@@ -670,38 +656,55 @@ main(int argc, char *argv[])
 		break;
 
     case 'I':
-            image.print_mtd_image = print_mtd_image; 
             image.input = NULL;
-            if (0 != image.print_mtd_image(&image))
-                fprintf(stderr, "Write Failed!\n");
+            if (0 != (status = print_mtd_image(&image)))
+                fprintf(stderr, "Info Failed!\n");
 		break;
 
 	case 'W':
-            if (5 != argc) {
+            if (3 != (argc - optind)) {
                 fprintf(stderr, "Must have 4 arguments for write\n");
                 usage(EXIT_FAILURE);
             }
-            image.input = argv[4];
-            image.write = image_write;
-            image.check_file_image = image_check;
-            if (0 != image.check_file_image(&image)) {
+            image.input = argv[optind + 2];
+            image.journal = journal;
+            image.resume = resume;
+            if ((journal || resume) && (0 == strcmp(image.input, "-"))) {
+                fprintf(stderr, "Only a write of a file can be journaled\n");
+                usage(EXIT_FAILURE);
+            }
+            if ((0 != strcmp(image.input, "-")) &&
+                (0 != bspimage_check_file(image.type, image.asic, image.input))) {
                 fprintf(stderr, "Image Check Failed!\n");
                 usage(EXIT_FAILURE);
             }
-            if (0 != image.write(&image))
+            if (0 != (status = write_mtd_image(&image)))
                 fprintf(stderr, "Write Failed!\n");
 		break;
 
+	case 'C':
+            if (NULL == bspimage_location(image.type, image.asic,
+                                          ('A' == image.select) ? 'B' : 'A')) {
+                fprintf(stderr, "No bank to clone %s from on %s\n",
+                        image.type, image.asic);
+                usage(EXIT_FAILURE);
+            }
+            if (0 != (status = clone_mtd_image(&image)))
+                fprintf(stderr, "Clone Failed!\n");
+		break;
+
 	case 'V':
-            image.write = image_write;
-            if (0 != image.write(&image))
-            fprintf(stderr, "Write Failed!\n");
+            if (0 != (status = verify_mtd_image(&image)))
+                fprintf(stderr, "Verify Failed!\n");
 		break;
 
 	default:
 		usage(EXIT_FAILURE);
 		break;
-
-	return EXIT_SUCCESS;
     }
+
+    if (0 != stats)
+        stats_print(stderr, ('j' == stats));
+
+    return (0 == status) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,32 @@
+/*
+ * image.h
+ *
+ * Copyright (C) 2014 LSI Logic
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __IMAGE__H__
+#define __IMAGE__H__
+
+#include "util.h"
+
+int daemon_run(const char *path, const char *asic);
+int update_run(const char *manifest, const char *asic);
+int scan_run(const char *directory, const char *asic, int json,
+	     char **keys, int key_count);
+int scrub_run(const char *asic, unsigned long blocks, int rewrite);
+
+#endif /* __IMAGE__H__ */
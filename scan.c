@@ -0,0 +1,544 @@
+/*
+ * scan.c
+ *
+ * Copyright (C) 2014 LSI Logic
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+  Decodes flash dumps collected from many boards, on a host.
+
+  The directory holds a sub-directory for each board, containing its
+  partitions as copied from /dev/mtdN, named mtdN.  Which partition is
+  which is taken from the layout of the given ASIC, as on a board.  A
+  missing dump is reported as such.
+
+  Each image (board, type and bank) is a task.  The tasks are dealt out
+  in equal runs to a thread per processor, and a thread that runs out
+  steals the second half of what another has left, so a few slow dumps
+  don't hold up the rest.  Dumps are mapped, not read.  The results are
+  printed in board order, as one CSV or JSON table, once all are done.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "bspimage.h"
+#include "image.h"
+#include "config.h"
+
+/*
+  ==============================================================================
+  Local
+  ==============================================================================
+*/
+
+#define IMAGE_TYPES 4
+#define TASKS_PER_BOARD (IMAGE_TYPES * 2)
+
+typedef struct scan_result {
+	const char *state;	/* NULL if there is no such image */
+	char message[BSPIMAGE_STRING_LENGTH];
+	int decoded;
+	bspimage_info_t info;
+	char **env;		/* values of the keys, NULL if not set */
+} scan_result_t;
+
+typedef struct scan_queue {
+	pthread_mutex_t lock;
+	unsigned long next;	/* first task not taken */
+	unsigned long end;
+} scan_queue_t;
+
+typedef struct scan_worker {
+	int index;
+	pthread_t thread;
+} scan_worker_t;
+
+static const char *types_[IMAGE_TYPES] = { "uboot", "spl", "param", "env" };
+
+static const char *directory_;
+static const char *asic_;
+static struct dirent **boards_;
+static unsigned long board_count_;
+static char **keys_;
+static int key_count_;
+static scan_result_t *results_;
+static scan_queue_t *queues_;
+static int worker_count_;
+
+/*
+  ------------------------------------------------------------------------------
+  select_board
+
+  scandir() filter, boards are the sub-directories.
+*/
+
+static int
+select_board(const struct dirent *entry)
+{
+	char *path;
+	struct stat board_stat;
+	int selected;
+
+	if ('.' == entry->d_name[0])
+		return 0;
+
+	if (0 > asprintf(&path, "%s/%s", directory_, entry->d_name))
+		return 0;
+
+	selected = (0 == stat(path, &board_stat) && S_ISDIR(board_stat.st_mode));
+	free(path);
+
+	return selected;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  take_task
+
+  Takes the next task of the worker's own run, or steals the second half
+  of another worker's.  Returns 0 when there is nothing left anywhere.
+*/
+
+static int
+take_task(int self, unsigned long *task)
+{
+	scan_queue_t *queue = &queues_[self];
+	scan_queue_t *victim;
+	unsigned long half;
+	int index;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->next < queue->end) {
+		*task = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+
+		return 1;
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	for (index = 1; index < worker_count_; ++index) {
+		victim = &queues_[(self + index) % worker_count_];
+		pthread_mutex_lock(&victim->lock);
+
+		if (victim->next >= victim->end) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+
+		half = (victim->end - victim->next + 1) / 2;
+		victim->end -= half;
+		pthread_mutex_unlock(&victim->lock);
+
+		/* the first stolen task is done now, the rest queued */
+		pthread_mutex_lock(&queue->lock);
+		*task = victim->end;
+		queue->next = victim->end + 1;
+		queue->end = victim->end + half;
+		pthread_mutex_unlock(&queue->lock);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  scan_image
+*/
+
+static void
+scan_image(unsigned long task)
+{
+	scan_result_t *result = &results_[task];
+	const char *board = boards_[task / TASKS_PER_BOARD]->d_name;
+	const char *type = types_[(task % TASKS_PER_BOARD) / 2];
+	char select = 'A' + (task % 2);
+	const char *location;
+	const bspimage_info_t *info;
+	const bspimage_verify_t *verify;
+	const char *value;
+	bspimage_t *image;
+	char *path;
+	int key;
+
+	if (NULL == (location = bspimage_location(type, asic_, select)))
+		return;
+
+	result->state = "missing";
+
+	if (0 > asprintf(&path, "%s/%s/%s", directory_, board,
+			 strrchr(location, '/') + 1))
+		return;
+
+	if (0 != access(path, F_OK) ||
+	    NULL == (image = bspimage_open_file(type, asic_, path))) {
+		free(path);
+
+		return;
+	}
+
+	result->state = "unreadable";
+
+	if (NULL != (info = bspimage_info(image))) {
+		result->decoded = 1;
+		result->info = *info;
+	}
+
+	if (NULL != (verify = bspimage_verify(image))) {
+		if (!verify->checked)
+			result->state = "unchecked";
+		else
+			result->state = verify->valid ? "valid" : "invalid";
+
+		strcpy(result->message, verify->message);
+	}
+
+	if (0 == strcmp(type, "env") && result->decoded && 0 < key_count_ &&
+	    NULL != (result->env = calloc(key_count_, sizeof(char *)))) {
+		for (key = 0; key < key_count_; ++key)
+			if (NULL != (value = bspimage_env_get(image, keys_[key])))
+				result->env[key] = strdup(value);
+	}
+
+	bspimage_close(image);
+	free(path);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  scan_thread
+*/
+
+static void *
+scan_thread(void *argument)
+{
+	scan_worker_t *worker = argument;
+	unsigned long task;
+
+	while (take_task(worker->index, &task))
+		scan_image(task);
+
+	return NULL;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  print_csv_field
+
+  Quotes the field if it needs it.
+*/
+
+static void
+print_csv_field(FILE *output, const char *field, int first)
+{
+	if (!first)
+		fputc(',', output);
+
+	if (NULL == field)
+		return;
+
+	if (NULL == strpbrk(field, ",\"\r\n")) {
+		fputs(field, output);
+
+		return;
+	}
+
+	fputc('"', output);
+
+	for (; '\0' != *field; ++field) {
+		if ('"' == *field)
+			fputc('"', output);
+
+		fputc(*field, output);
+	}
+
+	fputc('"', output);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  print_json_string
+*/
+
+static void
+print_json_string(FILE *output, const char *string)
+{
+	const unsigned char *character = (const unsigned char *)string;
+
+	fputc('"', output);
+
+	for (; '\0' != *character; ++character) {
+		if ('"' == *character || '\\' == *character)
+			fprintf(output, "\\%c", *character);
+		else if (0x20 > *character || 0x7f <= *character)
+			fprintf(output, "\\u%04x", *character);
+		else
+			fputc(*character, output);
+	}
+
+	fputc('"', output);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  print_row
+
+  Prints a row of the table, or its header if values is NULL.  Columns
+  without a value are empty in CSV and left out of JSON.
+*/
+
+static void
+print_row(FILE *output, int json, const char **names, const char **values,
+	  int count, int first_row)
+{
+	int column;
+	int first = 1;
+
+	if (json) {
+		fprintf(output, "%s\n  {", first_row ? "" : ",");
+
+		for (column = 0; column < count; ++column) {
+			if (NULL == values[column])
+				continue;
+
+			fprintf(output, "%s", first ? "" : ", ");
+			print_json_string(output, names[column]);
+			fprintf(output, ": ");
+			print_json_string(output, values[column]);
+			first = 0;
+		}
+
+		fprintf(output, "}");
+
+		return;
+	}
+
+	for (column = 0; column < count; ++column)
+		print_csv_field(output, (NULL == values) ? names[column] :
+				values[column], (0 == column));
+
+	fprintf(output, "\n");
+}
+
+/*
+  ------------------------------------------------------------------------------
+  print_results
+*/
+
+#define FIXED_COLUMNS 10
+
+static void
+print_results(FILE *output, int json)
+{
+	static const char *fixed[FIXED_COLUMNS] = {
+		"board", "image", "bank", "state", "message", "version",
+		"atf_version", "param_version", "chip_type", "env_count"
+	};
+	const char **names;
+	const char **values;
+	scan_result_t *result;
+	const char *type;
+	char bank[2] = { 0, 0 };
+	char param_version[16];
+	char chip_type[16];
+	char env_count[24];
+	unsigned long task;
+	int count = FIXED_COLUMNS + key_count_;
+	int key;
+	int first_row = 1;
+
+	names = calloc(count, sizeof(char *));
+	values = calloc(count, sizeof(char *));
+
+	if (NULL == names || NULL == values) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(names);
+		free(values);
+
+		return;
+	}
+
+	memcpy(names, fixed, sizeof(fixed));
+
+	for (key = 0; key < key_count_; ++key)
+		names[FIXED_COLUMNS + key] = keys_[key];
+
+	if (json)
+		fprintf(output, "[");
+	else
+		print_row(output, 0, names, NULL, count, 1);
+
+	for (task = 0; task < (board_count_ * TASKS_PER_BOARD); ++task) {
+		result = &results_[task];
+		type = types_[(task % TASKS_PER_BOARD) / 2];
+
+		if (NULL == result->state)
+			continue;
+
+		memset(values, 0, count * sizeof(char *));
+		bank[0] = 'A' + (task % 2);
+		values[0] = boards_[task / TASKS_PER_BOARD]->d_name;
+		values[1] = type;
+		values[2] = bank;
+		values[3] = result->state;
+
+		if ('\0' != result->message[0])
+			values[4] = result->message;
+
+		if (result->decoded && '\0' != result->info.version[0])
+			values[5] = result->info.version;
+
+		if (result->decoded && '\0' != result->info.atf_version[0])
+			values[6] = result->info.atf_version;
+
+		if (result->decoded && 0 == strcmp(type, "param")) {
+			sprintf(param_version, "0x%x",
+				result->info.param_version);
+			sprintf(chip_type, "0x%x", result->info.chip_type);
+			values[7] = param_version;
+			values[8] = chip_type;
+		}
+
+		if (result->decoded && 0 == strcmp(type, "env")) {
+			sprintf(env_count, "%lu", result->info.env_count);
+			values[9] = env_count;
+		}
+
+		for (key = 0; NULL != result->env && key < key_count_; ++key)
+			values[FIXED_COLUMNS + key] = result->env[key];
+
+		print_row(output, json, names, values, count, first_row);
+		first_row = 0;
+	}
+
+	if (json)
+		fprintf(output, "\n]\n");
+
+	free(names);
+	free(values);
+}
+
+/*
+  ==============================================================================
+  Public
+  ==============================================================================
+*/
+
+/*
+  ------------------------------------------------------------------------------
+  scan_run
+*/
+
+int
+scan_run(const char *directory, const char *asic, int json,
+	 char **keys, int key_count)
+{
+	scan_worker_t *workers = NULL;
+	unsigned long tasks;
+	unsigned long task;
+	long processors;
+	int started = 0;
+	int index;
+	int key;
+	int return_value = -1;
+
+	directory_ = directory;
+	asic_ = asic;
+	keys_ = keys;
+	key_count_ = key_count;
+
+	if (0 > (index = scandir(directory, &boards_, select_board, alphasort))) {
+		fprintf(stderr, "Unable to scan %s : %s\n",
+			directory, strerror(errno));
+
+		return -1;
+	}
+
+	board_count_ = index;
+	tasks = board_count_ * TASKS_PER_BOARD;
+
+	/* the arena can only be used by one thread */
+	processors = sysconf(_SC_NPROCESSORS_ONLN);
+	worker_count_ = (arena_enabled() || 1 > processors) ? 1 : processors;
+
+	if (worker_count_ > tasks && 0 < tasks)
+		worker_count_ = tasks;
+
+	results_ = calloc(tasks + 1, sizeof(scan_result_t));
+	queues_ = calloc(worker_count_, sizeof(scan_queue_t));
+	workers = calloc(worker_count_, sizeof(scan_worker_t));
+
+	if (NULL == results_ || NULL == queues_ || NULL == workers) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto cleanup;
+	}
+
+	for (index = 0; index < worker_count_; ++index) {
+		pthread_mutex_init(&queues_[index].lock, NULL);
+		queues_[index].next = tasks * index / worker_count_;
+		queues_[index].end = tasks * (index + 1) / worker_count_;
+		workers[index].index = index;
+	}
+
+	/* this thread is worker 0 */
+	for (index = 1; index < worker_count_; ++index)
+		if (0 == pthread_create(&workers[index].thread, NULL,
+					scan_thread, &workers[index]))
+			started = index;
+		else
+			break;
+
+	scan_thread(&workers[0]);
+
+	for (index = 1; index <= started; ++index)
+		pthread_join(workers[index].thread, NULL);
+
+	print_results(stdout, json);
+	return_value = 0;
+
+cleanup:
+
+	for (task = 0; NULL != results_ && task < tasks; ++task) {
+		for (key = 0; NULL != results_[task].env && key < key_count; ++key)
+			free(results_[task].env[key]);
+
+		free(results_[task].env);
+	}
+
+	for (index = 0; index < board_count_; ++index)
+		free(boards_[index]);
+
+	free(boards_);
+	free(results_);
+	free(queues_);
+	free(workers);
+
+	return return_value;
+}
@@ -0,0 +1,578 @@
+/*
+ * scrub.c
+ *
+ * Copyright (C) 2014 LSI Logic
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+  Scrubs the boot images a few erase blocks per run, so a bank that is
+  going bad is found before it is needed for failover, without the cost
+  of reading all of the flash at once.
+
+  The images are taken in turn, bank A then bank B, and each run reads
+  the next blocks after the ones the last run read, wrapping around.
+  Where it got to is kept in SCRUB_STATE, along with how many bitflips
+  each block needed corrected when it was last read.  A block is
+  degraded if a read needs SCRUB_BITFLIPS corrections or more, or more
+  than it did the last time.  With rewrite set, degraded blocks are
+  erased and programmed again with what was read.  Blocks the ECC
+  couldn't correct are reported, the image must be written or cloned.
+
+  Where the format has a checksum, it is taken over the blocks as they
+  are read and checked when the last block of the image has been.  The
+  header is read at the start of each image, and as a mismatch may only
+  mean the image was written during the pass, it is verified in full
+  before it is reported.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "util.h"
+#include "bspimage.h"
+#include "image.h"
+#include "config.h"
+
+/*
+  ==============================================================================
+  Local
+  ==============================================================================
+*/
+
+#define IMAGE_TYPES 4
+#define SCRUB_IMAGES (IMAGE_TYPES * 2)
+
+#define SCRUB_MAGIC 0x42535053	/* "BSPS" */
+
+/* the state file is this record followed by a uint16_t per block */
+typedef struct scrub_record {
+	uint32_t magic;
+	uint32_t blocks;	/* in all the images */
+	uint32_t image;		/* being scrubbed */
+	uint32_t block;		/* next one to read in it */
+	uint32_t passes;	/* over all the images */
+	uint32_t checked;	/* 1 if its checksum is being taken */
+	uint32_t offset;	/* what the checksum covers, see */
+	uint32_t ends[BSPIMAGE_CHECKSUM_ENDS];	/* bspimage_checksum_t */
+	uint32_t end_count;
+	uint32_t expected;
+	uint32_t crc;		/* of what it covers, so far */
+	uint32_t matched;	/* 1 once crc has been expected at an end */
+	uint32_t rcrc;		/* of the fields before it and the table */
+} scrub_record_t;
+
+typedef struct scrub_image {
+	const char *type;
+	char select;
+	const char *location;
+	unsigned long erasesize;
+	unsigned long blocks;
+	unsigned long first;	/* its first block in the table */
+} scrub_image_t;
+
+static const char *types_[IMAGE_TYPES] = { "uboot", "spl", "param", "env" };
+
+static const char *asic_;
+static scrub_image_t images_[SCRUB_IMAGES];
+static unsigned int image_count_;
+static unsigned long block_count_;
+static scrub_record_t record_;
+static uint16_t *flips_;	/* corrected when each block was last read */
+
+/*
+  ------------------------------------------------------------------------------
+  find_images
+
+  Lists the images of the ASIC and the geometry of their partitions.
+*/
+
+static int
+find_images(void)
+{
+	scrub_image_t *image;
+	mtd_device_t device;
+	const char *location;
+	int bank;
+	int type;
+
+	for (bank = 0; bank < 2; ++bank) {
+		for (type = 0; type < IMAGE_TYPES; ++type) {
+			if (NULL == (location = bspimage_location(types_[type],
+								  asic_,
+								  'A' + bank)))
+				continue;
+
+			if (0 != mtd_open(&device, location, O_RDONLY))
+				return -1;
+
+			image = &images_[image_count_++];
+			image->type = types_[type];
+			image->select = 'A' + bank;
+			image->location = location;
+			image->erasesize = device.info.erasesize;
+			image->blocks = (0 == device.info.erasesize) ? 0 :
+				device.info.size / device.info.erasesize;
+			image->first = block_count_;
+			block_count_ += image->blocks;
+			mtd_close(&device);
+		}
+	}
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  load_state
+
+  Carries on from the saved state, or starts again at the first block
+  if there is none that fits the images.
+*/
+
+static void
+load_state(void)
+{
+	unsigned long size = block_count_ * sizeof(uint16_t);
+	uint32_t rcrc;
+	int fd;
+
+	memset(&record_, 0, sizeof(record_));
+	memset(flips_, 0, size);
+
+	if (0 > (fd = open(SCRUB_STATE, O_RDONLY)))
+		goto fresh;
+
+	if (sizeof(record_) != read(fd, &record_, sizeof(record_)) ||
+	    size != read(fd, flips_, size)) {
+		close(fd);
+		goto invalid;
+	}
+
+	close(fd);
+	rcrc = get_crc32(&record_, offsetof(scrub_record_t, rcrc));
+	rcrc = update_crc32(rcrc, flips_, size);
+
+	if (SCRUB_MAGIC == record_.magic && rcrc == record_.rcrc &&
+	    block_count_ == record_.blocks && image_count_ > record_.image &&
+	    images_[record_.image].blocks > record_.block &&
+	    BSPIMAGE_CHECKSUM_ENDS >= record_.end_count)
+		return;
+
+invalid:
+
+	fprintf(stderr, "%s isn't valid for these partitions, starting "
+		"again\n", SCRUB_STATE);
+	memset(&record_, 0, sizeof(record_));
+	memset(flips_, 0, size);
+
+fresh:
+
+	record_.magic = SCRUB_MAGIC;
+	record_.blocks = block_count_;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  save_state
+
+  Replaces the state with rename(), so it is always the old or the new.
+*/
+
+static int
+save_state(void)
+{
+	unsigned long size = block_count_ * sizeof(uint16_t);
+	char path[sizeof(SCRUB_STATE) + 4];
+	int fd;
+
+	record_.rcrc = get_crc32(&record_, offsetof(scrub_record_t, rcrc));
+	record_.rcrc = update_crc32(record_.rcrc, flips_, size);
+	snprintf(path, sizeof(path), "%s.new", SCRUB_STATE);
+
+	if (0 > (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) ||
+	    sizeof(record_) != write(fd, &record_, sizeof(record_)) ||
+	    size != write(fd, flips_, size) ||
+	    0 != fsync(fd) || 0 != close(fd) ||
+	    0 != rename(path, SCRUB_STATE)) {
+		fprintf(stderr, "Unable to save %s : %s, the next scrub will "
+			"start again\n", SCRUB_STATE, strerror(errno));
+
+		if (0 <= fd)
+			close(fd);
+
+		unlink(path);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  start_image
+
+  Reads the header of the image about to be scrubbed from its first
+  block, to know what its checksum covers.  Returns -1 if it can't be
+  read or isn't valid, the blocks are still scrubbed.
+*/
+
+static int
+start_image(scrub_image_t *image)
+{
+	const bspimage_checksum_t *checksum;
+	bspimage_t *handle;
+	unsigned int index;
+
+	record_.checked = 0;
+	record_.crc = 0;
+	record_.matched = 0;
+
+	if (NULL == (handle = bspimage_open(image->type, asic_, image->select,
+					    O_RDONLY)))
+		return -1;
+
+	if (NULL == (checksum = bspimage_checksum(handle))) {
+		bspimage_close(handle);
+
+		return -1;
+	}
+
+	if (checksum->checked && !checksum->valid) {
+		printf("%s %c (%s): header isn't valid\n",
+		       image->type, image->select, image->location);
+		bspimage_close(handle);
+
+		return -1;
+	}
+
+	if (checksum->checked) {
+		record_.checked = 1;
+		record_.offset = checksum->offset;
+		record_.end_count = checksum->end_count;
+		record_.expected = checksum->crc32;
+
+		for (index = 0; index < checksum->end_count; ++index)
+			record_.ends[index] = checksum->ends[index];
+	}
+
+	bspimage_close(handle);
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  checksum_block
+
+  Adds the part of the block at start that the checksum covers to it,
+  noting a match at each of the ends.
+*/
+
+static void
+checksum_block(const unsigned char *data, unsigned long start,
+	       unsigned long length)
+{
+	unsigned long offset = start;
+	unsigned long end;
+	unsigned int index;
+
+	if (offset < record_.offset)
+		offset = record_.offset;
+
+	/* ends[0] is the largest */
+	while (offset < (start + length) && offset < record_.ends[0]) {
+		end = start + length;
+
+		for (index = 0; index < record_.end_count; ++index)
+			if (record_.ends[index] > offset &&
+			    record_.ends[index] < end)
+				end = record_.ends[index];
+
+		record_.crc = update_crc32(record_.crc,
+					   (void *)(data + (offset - start)),
+					   end - offset);
+
+		for (index = 0; index < record_.end_count; ++index)
+			if (record_.ends[index] == end &&
+			    record_.crc == record_.expected)
+				record_.matched = 1;
+
+		offset = end;
+	}
+}
+
+/*
+  ------------------------------------------------------------------------------
+  finish_image
+
+  Checks the checksum once the last block has been read.  Returns -1 if
+  the image isn't valid.
+*/
+
+static int
+finish_image(scrub_image_t *image)
+{
+	const bspimage_verify_t *verify;
+	bspimage_t *handle;
+	int return_value = -1;
+
+	if (!record_.checked)
+		return 0;
+
+	if (record_.matched) {
+		printf("%s %c (%s): crc32 ok\n",
+		       image->type, image->select, image->location);
+
+		return 0;
+	}
+
+	if (NULL == (handle = bspimage_open(image->type, asic_, image->select,
+					    O_RDONLY)))
+		return -1;
+
+	if (NULL != (verify = bspimage_verify(handle))) {
+		if (verify->valid)
+			printf("%s %c (%s): written during the scrub, %s\n",
+			       image->type, image->select, image->location,
+			       verify->message);
+		else
+			printf("%s %c (%s): %s\n", image->type, image->select,
+			       image->location, verify->message);
+
+		return_value = verify->valid ? 0 : -1;
+	}
+
+	bspimage_close(handle);
+
+	return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  scrub_block
+
+  Reads the next block of the image and reports it, with the shared
+  lock held.  Returns -1 if it is bad or can't be read, 1 if it is
+  degraded and rewrite is set.
+*/
+
+static int
+scrub_block(scrub_image_t *image, mtd_device_t *device, void *buffer,
+	    int rewrite)
+{
+	unsigned long offset = (unsigned long)record_.block * image->erasesize;
+	uint16_t *last = &flips_[image->first + record_.block];
+	mtd_scrub_t scrub;
+	int degraded;
+
+	if (0 != mtd_scrub_read(device, buffer, offset, &scrub))
+		return -1;
+
+	if (scrub.bad || 0 != scrub.failed) {
+		if (scrub.bad)
+			printf("%s %c (%s) block %u at 0x%lx: bad block\n",
+			       image->type, image->select, image->location,
+			       record_.block, offset);
+		else
+			printf("%s %c (%s) block %u at 0x%lx: %lu uncorrectable "
+			       "ECC errors, write or clone bank %c again\n",
+			       image->type, image->select, image->location,
+			       record_.block, offset, scrub.failed,
+			       image->select);
+
+		/* already reported, the checksum can't be taken */
+		record_.checked = 0;
+		*last = 0;
+
+		return -1;
+	}
+
+	if (record_.checked)
+		checksum_block(buffer, offset, image->erasesize);
+
+	degraded = (SCRUB_BITFLIPS <= scrub.corrected) ||
+		(0 != *last && *last < scrub.corrected);
+
+	if (0 != scrub.corrected)
+		printf("%s %c (%s) block %u at 0x%lx: %lu bitflips corrected, "
+		       "%u the last time%s\n",
+		       image->type, image->select, image->location,
+		       record_.block, offset, scrub.corrected, *last,
+		       degraded ? (rewrite ? ", rewriting" : ", degraded") : "");
+
+	*last = (0xffff < scrub.corrected) ? 0xffff : scrub.corrected;
+
+	return (degraded && rewrite) ? 1 : 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  rewrite_block
+
+  Writes the block scrub_block() read back, unless the partition has
+  been written since generation, when it was read.
+*/
+
+static int
+rewrite_block(scrub_image_t *image, mtd_device_t *device, const void *buffer,
+	      unsigned long generation)
+{
+	unsigned long offset = (unsigned long)record_.block * image->erasesize;
+
+	if (0 > mtd_scrub_rewrite(device, buffer, offset, generation, NULL))
+		return -1;
+
+	/* counted afresh from the rewrite, or the write that came first */
+	flips_[image->first + record_.block] = 0;
+
+	return 0;
+}
+
+/*
+  ==============================================================================
+  Public
+  ==============================================================================
+*/
+
+/*
+  ------------------------------------------------------------------------------
+  scrub_run
+
+  Scrubs the next blocks of the images, at most blocks of them.
+  Returns -1 if any were bad or unreadable, or an image isn't valid.
+*/
+
+int
+scrub_run(const char *asic, unsigned long blocks, int rewrite)
+{
+	scrub_image_t *image;
+	mtd_device_t device;
+	void *buffer;
+	unsigned long done = 0;
+	unsigned long generation;
+	int locked = 1;
+	int status;
+	int return_value = 0;
+
+	asic_ = asic;
+	image_count_ = 0;
+	block_count_ = 0;
+
+	if (0 != find_images())
+		return -1;
+
+	if (0 == block_count_) {
+		fprintf(stderr, "No partitions to scrub on %s\n", asic);
+
+		return -1;
+	}
+
+	if (NULL == (flips_ = malloc(block_count_ * sizeof(uint16_t)))) {
+		fprintf(stderr, "Unable to allocate memory\n");
+
+		return -1;
+	}
+
+	load_state();
+
+	if (blocks > block_count_)
+		blocks = block_count_;
+
+	while (done < blocks) {
+		image = &images_[record_.image];
+
+		if (0 == record_.block && 0 != start_image(image))
+			return_value = -1;
+
+		if (0 != mtd_open(&device, image->location,
+				  rewrite ? O_RDWR : O_RDONLY)) {
+			return_value = -1;
+			break;
+		}
+
+		if (NULL == (buffer = arena_alloc(image->erasesize))) {
+			fprintf(stderr, "Unable to allocate a %lu byte erase "
+				"block\n", image->erasesize);
+			mtd_close(&device);
+			return_value = -1;
+			break;
+		}
+
+		/*
+		  Shared while a block is read, so reads of the image go on,
+		  and exclusive only to rewrite it.
+		*/
+		while (done < blocks && record_.block < image->blocks) {
+			if (0 != mtd_lock(&device, 0)) {
+				locked = 0;
+				return_value = -1;
+				break;
+			}
+
+			generation = mtd_generation(image->location);
+			status = scrub_block(image, &device, buffer, rewrite);
+			mtd_unlock(&device);
+
+			if (1 == status)
+				status = rewrite_block(image, &device, buffer,
+						       generation);
+
+			if (0 != status)
+				return_value = -1;
+
+			++record_.block;
+			++done;
+		}
+
+		arena_free(buffer);
+		mtd_close(&device);
+
+		if (!locked)
+			break;
+
+		if (record_.block < image->blocks)
+			continue;
+
+		if (0 != finish_image(image))
+			return_value = -1;
+
+		record_.block = 0;
+
+		if (++record_.image == image_count_) {
+			record_.image = 0;
+			++record_.passes;
+		}
+	}
+
+	save_state();
+	printf("scrubbed %lu blocks, next %s %c block %u, %u passes done\n",
+	       done, images_[record_.image].type,
+	       images_[record_.image].select, record_.block, record_.passes);
+	free(flips_);
+	flips_ = NULL;
+
+	return return_value;
+}
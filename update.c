@@ -0,0 +1,362 @@
+/*
+ * update.c
+ *
+ * Copyright (C) 2014 LSI Logic
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+  Updates the images of one bank from a manifest, as a unit.
+
+  The manifest has a "TYPE BANK FILE" line for each image to write, blank
+  lines and lines starting with '#' are ignored.  All lines must name
+  the same bank, and each type can only be given once:
+
+	spl   B /tmp/spl.img
+	uboot B /tmp/u-boot.img
+	param B /tmp/param.bin
+	env   B /tmp/env.bin
+
+  Every file is checked, and every partition opened, before anything is
+  erased.  The images other than env are then written and verified at
+  the same time, a thread for each partition, so the update takes about
+  as long as the slowest of them.  env is written last, and only if all
+  the others verified: it is the commit point, a failed update leaves
+  the old environment in place.  The other bank is never opened.
+
+  When an arena is used the images are written one after the other, as
+  the arena can only be used by one thread.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "bspimage.h"
+#include "image.h"
+#include "config.h"
+
+/*
+  ==============================================================================
+  Local
+  ==============================================================================
+*/
+
+#define IMAGE_TYPES 4
+
+typedef struct update_entry {
+	const char *type;
+	char *input;
+	bspimage_t *image;
+	pthread_t thread;
+	int started;
+	int status;
+} update_entry_t;
+
+/* env is last, it is written after the others */
+static const char *types_[IMAGE_TYPES] = { "spl", "uboot", "param", "env" };
+
+/*
+  ------------------------------------------------------------------------------
+  parse_manifest
+
+  Fills in entries (indexed as types_) and the bank from the manifest.
+*/
+
+static int
+parse_manifest(const char *manifest, update_entry_t *entries, char *select)
+{
+	FILE *file;
+	char *line = NULL;
+	char *save;
+	char *type;
+	char *bank;
+	char *input;
+	size_t size = 0;
+	unsigned long number = 0;
+	int index;
+	int return_value = -1;
+
+	if (NULL == (file = fopen(manifest, "r"))) {
+		fprintf(stderr, "Error opening %s: %s\n",
+			manifest, strerror(errno));
+
+		return -1;
+	}
+
+	*select = 0;
+
+	while (0 < getline(&line, &size, file)) {
+		++number;
+
+		if (NULL == (type = strtok_r(line, " \t\r\n", &save)) ||
+		    '#' == *type)
+			continue;
+
+		bank = strtok_r(NULL, " \t\r\n", &save);
+		input = strtok_r(NULL, " \t\r\n", &save);
+
+		if (NULL == input || NULL != strtok_r(NULL, " \t\r\n", &save)) {
+			fprintf(stderr, "%s:%lu: expected TYPE BANK FILE\n",
+				manifest, number);
+			goto cleanup;
+		}
+
+		for (index = 0; index < IMAGE_TYPES; ++index)
+			if (0 == strcmp(type, types_[index]))
+				break;
+
+		if (IMAGE_TYPES == index) {
+			fprintf(stderr, "%s:%lu: image type should be uboot, "
+				"spl, param or env\n", manifest, number);
+			goto cleanup;
+		}
+
+		if (NULL != entries[index].input) {
+			fprintf(stderr, "%s:%lu: %s is given twice\n",
+				manifest, number, type);
+			goto cleanup;
+		}
+
+		if (1 != strlen(bank) ||
+		    ('A' != toupper(*bank) && 'B' != toupper(*bank))) {
+			fprintf(stderr, "%s:%lu: Bank must be either A or B!\n",
+				manifest, number);
+			goto cleanup;
+		}
+
+		if (0 != *select && *select != toupper(*bank)) {
+			fprintf(stderr, "%s:%lu: only one bank can be updated\n",
+				manifest, number);
+			goto cleanup;
+		}
+
+		*select = toupper(*bank);
+
+		if (NULL == (entries[index].input = strdup(input))) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			goto cleanup;
+		}
+	}
+
+	if (0 == *select) {
+		fprintf(stderr, "%s: no images to update\n", manifest);
+		goto cleanup;
+	}
+
+	return_value = 0;
+
+cleanup:
+
+	free(line);
+	fclose(file);
+
+	return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  check_entry
+
+  Checks that the file is a valid image that fits, and opens the
+  partition for writing.
+*/
+
+static int
+check_entry(update_entry_t *entry, const char *asic, char select)
+{
+	bspimage_t *file;
+	const bspimage_verify_t *verify;
+	unsigned long size;
+
+	if (NULL == bspimage_location(entry->type, asic, select)) {
+		fprintf(stderr, "No bank %c exists for %s image on %s hardware\n",
+			select, entry->type, asic);
+
+		return -1;
+	}
+
+	if (0 != bspimage_check_file(entry->type, asic, entry->input)) {
+		fprintf(stderr, "%s is not a valid %s image\n",
+			entry->input, entry->type);
+
+		return -1;
+	}
+
+	if (NULL == (file = bspimage_open_file(entry->type, asic, entry->input)))
+		return -1;
+
+	size = bspimage_device(file)->info.size;
+	verify = bspimage_verify(file);
+
+	if (NULL == verify || !verify->valid) {
+		fprintf(stderr, "%s: %s\n", entry->input,
+			(NULL == verify) ? "unable to verify" : verify->message);
+		bspimage_close(file);
+
+		return -1;
+	}
+
+	bspimage_close(file);
+
+	if (NULL == (entry->image = bspimage_open(entry->type, asic, select,
+						  O_RDWR)))
+		return -1;
+
+	if (size > bspimage_device(entry->image)->info.size) {
+		fprintf(stderr, "%s doesn't fit in %s (%u bytes)\n",
+			entry->input, bspimage_device(entry->image)->name,
+			bspimage_device(entry->image)->info.size);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  write_entry
+
+  Writes an image and reads it back to check it.
+*/
+
+static void *
+write_entry(void *argument)
+{
+	update_entry_t *entry = argument;
+	const bspimage_verify_t *verify;
+	unsigned long skipped;
+
+	entry->status = -1;
+
+	if (0 != bspimage_write(entry->image, entry->input, &skipped)) {
+		fprintf(stderr, "Write of %s to %s failed\n", entry->input,
+			bspimage_device(entry->image)->name);
+
+		return NULL;
+	}
+
+	if (NULL == (verify = bspimage_verify(entry->image)) || !verify->valid) {
+		fprintf(stderr, "%s doesn't verify after writing %s: %s\n",
+			bspimage_device(entry->image)->name, entry->input,
+			(NULL == verify) ? "unable to read" : verify->message);
+
+		return NULL;
+	}
+
+	printf("\t%s: wrote %s to %s, %lu blank pages skipped, %s\n",
+	       entry->type, entry->input, bspimage_device(entry->image)->name,
+	       skipped, verify->message);
+	entry->status = 0;
+
+	/* leaves an arena free for the next image */
+	bspimage_release(entry->image);
+
+	return NULL;
+}
+
+/*
+  ==============================================================================
+  Public
+  ==============================================================================
+*/
+
+/*
+  ------------------------------------------------------------------------------
+  update_run
+*/
+
+int
+update_run(const char *manifest, const char *asic)
+{
+	update_entry_t entries[IMAGE_TYPES];
+	const int env = IMAGE_TYPES - 1;
+	char select;
+	int index;
+	int return_value = -1;
+
+	memset(entries, 0, sizeof(entries));
+
+	for (index = 0; index < IMAGE_TYPES; ++index)
+		entries[index].type = types_[index];
+
+	if (0 != parse_manifest(manifest, entries, &select))
+		goto cleanup;
+
+	for (index = 0; index < IMAGE_TYPES; ++index)
+		if (NULL != entries[index].input &&
+		    0 != check_entry(&entries[index], asic, select))
+			goto cleanup;
+
+	printf("update of bank %c on %s:\n", select, asic);
+	fflush(stdout);
+
+	for (index = 0; index < env; ++index) {
+		if (NULL == entries[index].input)
+			continue;
+
+		if (!arena_enabled() &&
+		    0 == pthread_create(&entries[index].thread, NULL,
+					write_entry, &entries[index]))
+			entries[index].started = 1;
+		else
+			write_entry(&entries[index]);
+	}
+
+	return_value = 0;
+
+	for (index = 0; index < env; ++index) {
+		if (entries[index].started)
+			pthread_join(entries[index].thread, NULL);
+
+		if (NULL != entries[index].input && 0 != entries[index].status)
+			return_value = -1;
+	}
+
+	if (0 != return_value) {
+		if (NULL != entries[env].input)
+			fprintf(stderr, "Bank %c is incomplete, the environment "
+				"was not written\n", select);
+		goto cleanup;
+	}
+
+	if (NULL != entries[env].input) {
+		write_entry(&entries[env]);
+		return_value = entries[env].status;
+	}
+
+	if (0 == return_value)
+		printf("bank %c updated\n", select);
+
+cleanup:
+
+	/* in the reverse of the order they were opened */
+	for (index = IMAGE_TYPES - 1; index >= 0; --index) {
+		bspimage_close(entries[index].image);
+		free(entries[index].input);
+	}
+
+	return return_value;
+}
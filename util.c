@@ -18,19 +18,29 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <linux/limits.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "util.h"
+#include "config.h"
 
 /*
   ==============================================================================
@@ -105,6 +115,49 @@ static unsigned long crc32_look_up_table_[256] = {
 	/* 252 -- */  3020668471u, 3272380065u, 1510334235u,  755167117u
 };
 
+/* Fixed memory arena used when memory is bounded (see arena_init()). */
+static unsigned char *arena_base_ = NULL;
+static unsigned long arena_size_ = 0;
+static unsigned long arena_used_ = 0;
+
+/* Per phase timing, collected when stats_enable() has been called. */
+#define STATS_BUCKETS 32
+
+static const char *stats_names_[PHASE_COUNT] = {
+	"open", "memgetinfo", "erase", "program", "read", "verify", "checksum",
+	"lock", "pace", "input"
+};
+
+static struct {
+	unsigned long calls;
+	unsigned long long bytes;
+	unsigned long long nanoseconds;
+	unsigned long histogram[STATS_BUCKETS];	/* by log2(microseconds) */
+} stats_[PHASE_COUNT];
+
+static int stats_enabled_ = 0;
+static pthread_mutex_t stats_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  Adaptive request sizing for flash reads and writes (see io_transfer()).
+  Requests start at IO_INITIAL bytes and are kept between IO_MINIMUM and
+  IO_MAXIMUM, sized so each one finishes well inside the deadline.  The
+  default deadline is far below the SSP timeout that one large read of
+  a 56xx/XLF partition used to trip.
+*/
+#define IO_MINIMUM  4096
+#define IO_INITIAL  0x10000
+#define IO_MAXIMUM  0x400000
+#define IO_DEADLINE 100000	/* microseconds per request */
+
+/* smallest unit checked for blank pages when writing, a NOR page */
+#define MTD_BLANK_PAGE 256
+
+static unsigned long io_deadline_ = IO_DEADLINE;
+
+/* read and write, per thread so transfers on other devices don't interfere */
+static __thread unsigned long io_chunk_[2] = { IO_INITIAL, IO_INITIAL };
+
 /*
   ==============================================================================
   Public Implementation
@@ -113,168 +166,2000 @@ static unsigned long crc32_look_up_table_[256] = {
 
 /*
   ------------------------------------------------------------------------------
-  get_crc32
+  get_crc32
+*/
+
+uint32_t
+get_crc32(void *start, unsigned long size)
+{
+	return update_crc32(0, start, size);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  update_crc32
+
+  Continues a crc32 over another piece of data, so large areas can be
+  checksummed a block at a time.  update_crc32(0, ...) == get_crc32(...).
+*/
+
+uint32_t
+update_crc32(uint32_t previous, void *start, unsigned long size)
+{
+	unsigned long crc = ~previous & 0xffffffffUL;
+	unsigned long index;
+	unsigned char *data = start;
+	unsigned long long timer = stats_start();
+
+	for (index = 0; index < size; index++) {
+		unsigned long temp = (crc ^ *(data++)) & 0x000000ff;
+		crc = ((crc >> 8) & 0x00ffffff) ^ crc32_look_up_table_[temp];
+	}
+
+	stats_stop(PHASE_CHECKSUM, timer, size);
+
+	return ~crc;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  io_transfer
+
+  Reads or writes length bytes at offset as a series of requests.  Each
+  request is timed: the request size doubles while requests take less
+  than a quarter of the deadline, and is scaled back towards half the
+  deadline when one takes longer than that.  Reads and writes are sized
+  separately, as they run at very different rates.
+
+  Requests are kept to multiples of unit, and at least one unit.  For
+  writes it is the page size, as NAND only takes whole pages.
+*/
+
+static int
+io_transfer(int fd, void *buffer, unsigned long length, unsigned long offset,
+	    unsigned long unit, int write)
+{
+	unsigned long *chunk = &io_chunk_[write ? 1 : 0];
+	unsigned long request;
+	unsigned long long elapsed;
+	struct timespec start;
+	struct timespec end;
+	ssize_t result;
+	unsigned long done;
+
+	if (0 == unit)
+		unit = 1;
+
+	while (0 < length) {
+		/* the chunk may have been sized for another device */
+		request = *chunk - (*chunk % unit);
+
+		if (unit > request)
+			request = unit;
+
+		if (length < request)
+			request = length;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (write)
+			result = pwrite(fd, buffer, request, offset);
+		else
+			result = pread(fd, buffer, request, offset);
+
+		if (0 > result && EINTR == errno)
+			continue;
+
+		if (0 >= result) {
+			/* a partition can't end before its size */
+			if (0 == result)
+				errno = EIO;
+
+			return -1;
+		}
+
+		done = (unsigned long)result;
+
+		/* the rest of a page written in part is written again */
+		if (write && done < request) {
+			if (unit > done) {
+				errno = EIO;
+
+				return -1;
+			}
+
+			done -= (done % unit);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed = (unsigned long long)(end.tv_sec - start.tv_sec) *
+			1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+
+		if (elapsed > (io_deadline_ / 2)) {
+			*chunk = (unsigned long)(done * (io_deadline_ / 2) / elapsed);
+			*chunk -= (*chunk % unit);
+
+			if (unit > *chunk)
+				*chunk = unit;
+		} else if (elapsed < (io_deadline_ / 4) && done == *chunk &&
+			   IO_MAXIMUM > *chunk) {
+			*chunk *= 2;
+		}
+
+		buffer += done;
+		offset += done;
+		length -= done;
+	}
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  io_set_deadline
+
+  Sets how long, in microseconds, a single flash read or write request
+  may take.
+*/
+
+void
+io_set_deadline(unsigned long microseconds)
+{
+	io_deadline_ = microseconds;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  io_read
+*/
+
+int
+io_read(int fd, void *buffer, unsigned long length, unsigned long offset)
+{
+	return io_transfer(fd, buffer, length, offset, IO_MINIMUM, 0);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  io_write
+
+  Writes in requests of whole pages of page bytes, the writesize.
+*/
+
+int
+io_write(int fd, const void *buffer, unsigned long length, unsigned long offset,
+	 unsigned long page)
+{
+	return io_transfer(fd, (void *)buffer, length, offset, page, 1);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  Write pacing
+
+  Erasing and programming can be slowed down so a write doesn't hog the
+  flash controller, for staging the inactive bank on a live board.  After
+  each erase block the write sleeps long enough to keep to whichever is
+  slowest of:
+
+  - the rate, in bytes of erase block per second
+  - the duty cycle, the percentage of the time spent erasing and
+    programming
+  - the finish time, spreading what is left evenly over the time left,
+    so the write is as slow as it can be and still be done by then
+
+  Once any of them is set, the write also yields the processor between
+  blocks.  Each write is paced on its own, so writes of several
+  partitions at once are each held to the rate.
+*/
+
+static unsigned long qos_rate_;
+static unsigned int qos_duty_;
+static unsigned long long qos_finish_;	/* CLOCK_MONOTONIC nanoseconds */
+
+/*
+  ------------------------------------------------------------------------------
+  monotonic
+*/
+
+static unsigned long long
+monotonic(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  qos_set_rate
+
+  Limits writes to bytes per second, 0 for no limit.
+*/
+
+void
+qos_set_rate(unsigned long bytes)
+{
+	qos_rate_ = bytes;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  qos_set_duty
+
+  Limits writes to being busy percent of the time, 0 or 100 for no limit.
+*/
+
+void
+qos_set_duty(unsigned int percent)
+{
+	qos_duty_ = (100 <= percent) ? 0 : percent;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  qos_set_finish
+
+  Paces writes to finish at the wall clock time finish, 0 for none.
+*/
+
+void
+qos_set_finish(time_t finish)
+{
+	time_t now = time(NULL);
+
+	if (0 == finish)
+		qos_finish_ = 0;
+	else
+		qos_finish_ = monotonic() + ((finish > now) ?
+			(unsigned long long)(finish - now) * 1000000000ULL : 0);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  qos_background
+
+  Lowers the I/O and CPU priority of the process, for writes that can
+  wait for everything else.
+*/
+
+int
+qos_background(void)
+{
+	/* ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE), no header */
+	if (0 != syscall(SYS_ioprio_set, 1, 0, 3 << 13))
+		fprintf(stderr, "Unable to lower the I/O priority : %s\n",
+			strerror(errno));
+
+	errno = 0;
+
+	if (-1 == nice(QOS_NICE) && 0 != errno) {
+		fprintf(stderr, "Unable to lower the priority : %s\n",
+			strerror(errno));
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  qos_pace
+
+  Called after each erase block, which took from start until now,
+  with left bytes still to erase.
+*/
+
+static void
+qos_pace(unsigned long long start, unsigned long bytes, unsigned long left)
+{
+	unsigned long long now;
+	unsigned long long busy;
+	unsigned long long period = 0;
+	unsigned long long wanted;
+	unsigned long long timer;
+	struct timespec pause;
+
+	if (0 == qos_rate_ && 0 == qos_duty_ && 0 == qos_finish_)
+		return;
+
+	now = monotonic();
+	busy = now - start;
+
+	if (0 != qos_rate_)
+		period = (unsigned long long)bytes * 1000000000ULL / qos_rate_;
+
+	if (0 != qos_duty_ &&
+	    (wanted = busy * 100 / qos_duty_) > period)
+		period = wanted;
+
+	/* this block and each one left take the same share of what's left */
+	if (0 != qos_finish_ && qos_finish_ > now &&
+	    (wanted = (qos_finish_ - now + busy) / (left / bytes + 1)) > period)
+		period = wanted;
+
+	if (period <= busy) {
+		sched_yield();
+
+		return;
+	}
+
+	timer = stats_start();
+	pause.tv_sec = (period - busy) / 1000000000ULL;
+	pause.tv_nsec = (period - busy) % 1000000000ULL;
+
+	while (0 != nanosleep(&pause, &pause) && EINTR == errno)
+		;
+
+	stats_stop(PHASE_PACE, timer, 0);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  stats_enable
+*/
+
+void
+stats_enable(void)
+{
+	stats_enabled_ = 1;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  stats_start
+
+  Returns a timestamp to pass to stats_stop(), or 0 if stats are off.
+*/
+
+unsigned long long
+stats_start(void)
+{
+	struct timespec now;
+
+	if (!stats_enabled_)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  stats_stop
+
+  Accounts one call of phase, started at start, that moved bytes.  Erase
+  and program are called an erase block at a time, so their histograms
+  are per erase block latencies.
+*/
+
+void
+stats_stop(phase_t phase, unsigned long long start, unsigned long bytes)
+{
+	unsigned long long elapsed;
+	unsigned long microseconds;
+	int bucket = 0;
+
+	if (!stats_enabled_)
+		return;
+
+	elapsed = stats_start() - start;
+	pthread_mutex_lock(&stats_lock_);
+	stats_[phase].calls++;
+	stats_[phase].bytes += bytes;
+	stats_[phase].nanoseconds += elapsed;
+
+	for (microseconds = elapsed / 1000; 0 != microseconds;
+	     microseconds >>= 1)
+		++bucket;
+
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+
+	stats_[phase].histogram[bucket]++;
+	pthread_mutex_unlock(&stats_lock_);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  stats_print
+
+  Histogram bucket n counts calls that took less than 2^n microseconds
+  (and at least 2^(n-1)).
+*/
+
+void
+stats_print(FILE *output, int json)
+{
+	int phase;
+	int bucket;
+	double seconds;
+	double rate;
+	const char *separator = "";
+
+	if (json)
+		fprintf(output, "{\"phases\":[");
+	else
+		fprintf(output, "%-12s %8s %12s %12s %10s\n",
+			"phase", "calls", "bytes", "seconds", "MB/s");
+
+	for (phase = 0; phase < PHASE_COUNT; ++phase) {
+		if (0 == stats_[phase].calls)
+			continue;
+
+		seconds = stats_[phase].nanoseconds / 1e9;
+		rate = (0 < seconds) ? (stats_[phase].bytes / seconds / 1e6) : 0;
+
+		if (json) {
+			fprintf(output, "%s{\"phase\":\"%s\",\"calls\":%lu,"
+				"\"bytes\":%llu,\"seconds\":%.6f,"
+				"\"mb_per_s\":%.3f,\"histogram_us\":{",
+				separator, stats_names_[phase],
+				stats_[phase].calls, stats_[phase].bytes,
+				seconds, rate);
+			separator = "";
+
+			for (bucket = 0; bucket < STATS_BUCKETS; ++bucket) {
+				if (0 == stats_[phase].histogram[bucket])
+					continue;
+
+				fprintf(output, "%s\"%lu\":%lu", separator,
+					1UL << bucket,
+					stats_[phase].histogram[bucket]);
+				separator = ",";
+			}
+
+			fprintf(output, "}}");
+			separator = ",";
+		} else {
+			fprintf(output, "%-12s %8lu %12llu %12.6f %10.3f\n",
+				stats_names_[phase], stats_[phase].calls,
+				stats_[phase].bytes, seconds, rate);
+
+			for (bucket = 0; bucket < STATS_BUCKETS; ++bucket) {
+				if (0 == stats_[phase].histogram[bucket])
+					continue;
+
+				fprintf(output, "%12s < %8lu us : %lu\n", "",
+					1UL << bucket,
+					stats_[phase].histogram[bucket]);
+			}
+		}
+	}
+
+	if (json)
+		fprintf(output, "]}\n");
+}
+
+/*
+  ------------------------------------------------------------------------------
+  arena_init
+
+  Bounds all further buffer allocations to a single block of size bytes,
+  allocated once here.  Buffers are released in the reverse order they
+  were allocated.  Without arena_init(), arena_alloc() is just malloc().
+*/
+
+int
+arena_init(unsigned long size)
+{
+	if (NULL == (arena_base_ = malloc(size))) {
+		fprintf(stderr, "Unable to allocate a %lu byte arena : %s\n",
+			size, strerror(errno));
+
+		return -1;
+	}
+
+	/* Touch the arena so running short happens now, not mid-write. */
+	memset(arena_base_, 0, size);
+	arena_size_ = size;
+	arena_used_ = 0;
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  arena_alloc
+*/
+
+void *
+arena_alloc(unsigned long size)
+{
+	void *buffer;
+
+	if (NULL == arena_base_) {
+		if (NULL == (buffer = malloc(size)))
+			fprintf(stderr, "Unable to allocate %lu bytes\n", size);
+
+		return buffer;
+	}
+
+	size = (size + 15) & ~15UL;
+
+	if (size > (arena_size_ - arena_used_)) {
+		fprintf(stderr, "Memory arena too small: %lu bytes needed, "
+			"%lu of %lu available\n",
+			size, arena_size_ - arena_used_, arena_size_);
+
+		return NULL;
+	}
+
+	buffer = arena_base_ + arena_used_;
+	arena_used_ += size;
+
+	return buffer;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  arena_free
+
+  Releases buffer and everything allocated from the arena after it.
+*/
+
+void
+arena_free(void *buffer)
+{
+	unsigned char *address = buffer;
+
+	if (NULL == arena_base_) {
+		free(buffer);
+
+		return;
+	}
+
+	if (address >= arena_base_ && address < (arena_base_ + arena_used_))
+		arena_used_ = address - arena_base_;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  arena_enabled
+
+  Returns non-zero if allocations come from the arena.  The arena isn't
+  thread safe, so only one thread may allocate from it.
+*/
+
+int
+arena_enabled(void)
+{
+	return (NULL != arena_base_);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  arena_chunk
+
+  Returns the largest multiple of unit, no bigger than wanted, that can
+  still be allocated, or 0 if not even one unit fits.
+*/
+
+unsigned long
+arena_chunk(unsigned long unit, unsigned long wanted)
+{
+	unsigned long available;
+
+	if (NULL == arena_base_)
+		available = ULONG_MAX;
+	else
+		available = arena_size_ - arena_used_;
+
+	if (wanted > available)
+		wanted = available;
+
+	if (1 < unit)
+		wanted -= (wanted % unit);
+
+	return wanted;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  reader_attach
+
+  A reader gives access to the first size bytes of an open partition
+  through a window buffer.  With no arena the window covers everything,
+  so the partition is read once; in an arena it is as many units (erase
+  blocks) as fit and the partition is streamed through it.  The caller
+  keeps ownership of fd.
+*/
+
+int
+reader_attach(mtd_reader_t *reader, int fd, const char *partition,
+	      unsigned long size, unsigned long unit)
+{
+	memset(reader, 0, sizeof(mtd_reader_t));
+	reader->fd = -1;
+	reader->name = partition;
+	reader->size = size;
+
+	if (0 == (reader->window_size = arena_chunk(unit, size))) {
+		fprintf(stderr, "Memory arena too small for a %lu byte block\n",
+			unit);
+
+		return -1;
+	}
+
+	if (NULL == (reader->window = arena_alloc(reader->window_size)))
+		return -1;
+
+	reader->fd = fd;
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  reader_close
+*/
+
+void
+reader_close(mtd_reader_t *reader)
+{
+	if (reader->mapped)
+		munmap(reader->window, reader->size);
+	else if (NULL != reader->window)
+		arena_free(reader->window);
+
+	reader->fd = -1;
+	reader->window = NULL;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  reader_map
+
+  Like reader_attach(), but maps the first size bytes of fd read only,
+  so they are used in place instead of being copied into a window.  If
+  fd can't be mapped, it falls back to reader_attach().
+*/
+
+int
+reader_map(mtd_reader_t *reader, int fd, const char *partition,
+	   unsigned long size, unsigned long unit)
+{
+	void *mapping;
+
+	mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (MAP_FAILED == mapping)
+		return reader_attach(reader, fd, partition, size, unit);
+
+	memset(reader, 0, sizeof(mtd_reader_t));
+	reader->fd = fd;
+	reader->name = partition;
+	reader->size = size;
+	reader->window = mapping;
+	reader->window_size = size;
+	reader->window_length = size;
+	reader->mapped = 1;
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  reader_get
+
+  Returns a pointer to length bytes at offset, valid until the next call.
+*/
+
+const void *
+reader_get(mtd_reader_t *reader, unsigned long offset, unsigned long length)
+{
+	unsigned long fill;
+	unsigned long long timer;
+
+	if (offset > reader->size || length > (reader->size - offset)) {
+		fprintf(stderr, "0x%lx bytes at 0x%lx is outside %s\n",
+			length, offset, reader->name);
+
+		return NULL;
+	}
+
+	if (offset >= reader->window_offset &&
+	    (offset + length) <= (reader->window_offset + reader->window_length))
+		return reader->window + (offset - reader->window_offset);
+
+	if (length > reader->window_size) {
+		fprintf(stderr, "Memory arena too small for 0x%lx bytes of %s\n",
+			length, reader->name);
+
+		return NULL;
+	}
+
+	fill = reader->size - offset;
+
+	if (fill > reader->window_size)
+		fill = reader->window_size;
+
+	timer = stats_start();
+
+	if (0 != io_read(reader->fd, reader->window, fill, offset)) {
+		fprintf(stderr, "Unable to read %s at 0x%lx : %s\n",
+			reader->name, offset, strerror(errno));
+		reader->window_length = 0;
+
+		return NULL;
+	}
+
+	stats_stop(PHASE_READ, timer, fill);
+
+	reader->window_offset = offset;
+	reader->window_length = fill;
+
+	return reader->window;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  reader_find
+
+  Returns the offset of the first match of needle at or after offset, or
+  -1.  Consecutive windows overlap so matches across them are found.
+*/
+
+long
+reader_find(mtd_reader_t *reader, unsigned long offset,
+	    const void *needle, unsigned long length)
+{
+	const void *data;
+	const void *match;
+	unsigned long size;
+
+	while (0 < length && (offset + length) <= reader->size) {
+		size = reader->size - offset;
+
+		if (size > reader->window_size)
+			size = reader->window_size;
+
+		if (size < length)
+			break;
+
+		if (NULL == (data = reader_get(reader, offset, size)))
+			break;
+
+		if (NULL != (match = memmem(data, size, needle, length)))
+			return offset + (match - data);
+
+		if (size == (reader->size - offset))
+			break;
+
+		offset += size - length + 1;
+	}
+
+	return -1;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  reader_string
+
+  Returns the NUL terminated string at offset, or NULL if it doesn't end
+  inside the partition or is longer than the window.
+*/
+
+const char *
+reader_string(mtd_reader_t *reader, unsigned long offset)
+{
+	const char *string;
+	unsigned long length;
+	int retry;
+
+	for (retry = 0; retry < 2; ++retry) {
+		if (retry || offset < reader->window_offset ||
+		    offset >= (reader->window_offset + reader->window_length)) {
+			length = reader->size - offset;
+
+			if (length > reader->window_size)
+				length = reader->window_size;
+
+			if (NULL == reader_get(reader, offset, length))
+				return NULL;
+		}
+
+		string = reader->window + (offset - reader->window_offset);
+		length = reader->window_offset + reader->window_length - offset;
+
+		if (NULL != memchr(string, 0, length))
+			return string;
+
+		if (offset == reader->window_offset)
+			break;
+	}
+
+	fprintf(stderr, "Unterminated string at 0x%lx in %s\n",
+		offset, reader->name);
+
+	return NULL;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  Partition locks
+
+  Processes using the same partition take flock() locks on it, shared
+  to read and exclusive to erase and program, so reads can run together
+  but never during a write, and two writes never overlap.  The locks are
+  advisory, they only keep out other users of these functions.  A lock
+  is waited for at most lock_wait_ seconds, polling, so a stuck process
+  can't hang the ones behind it.
+
+  A write generation is kept for each partition, in a small file in
+  GENERATION_DIRECTORY, so a process that caches what it read can tell
+  when another one has written the partition since.  It is counted up
+  when an exclusive lock is released after an erase, which the erase and
+  program paths mark in the device, so a lock that wrote nothing leaves
+  the readers' caches alone.
+*/
+
+static unsigned long lock_wait_ = LOCK_WAIT;
+
+/*
+  ------------------------------------------------------------------------------
+  lock_fd
+*/
+
+static int
+lock_fd(int fd, const char *name, int exclusive)
+{
+	int operation = exclusive ? LOCK_EX : LOCK_SH;
+	unsigned long long timer = stats_start();
+	struct timespec start;
+	struct timespec now;
+	useconds_t pause = 1000;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (0 != flock(fd, operation | LOCK_NB)) {
+		if (EWOULDBLOCK != errno && EINTR != errno) {
+			fprintf(stderr, "Unable to lock %s : %s\n",
+				name, strerror(errno));
+
+			return -1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if ((unsigned long)(now.tv_sec - start.tv_sec) >= lock_wait_) {
+			fprintf(stderr, "%s is still in use after %lu seconds\n",
+				name, lock_wait_);
+
+			return -1;
+		}
+
+		usleep(pause);
+
+		if (pause < 100000)
+			pause *= 2;
+	}
+
+	stats_stop(PHASE_LOCK, timer, 0);
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  generation_path
+*/
+
+static void
+generation_path(const char *partition, char *path, unsigned long size)
+{
+	const char *name = (NULL == strrchr(partition, '/')) ?
+		partition : strrchr(partition, '/') + 1;
+
+	snprintf(path, size, "%s/image-%s.generation", GENERATION_DIRECTORY,
+		 name);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  count_write
+
+  Counts up the write generation, called with the exclusive lock held
+  so only one process at a time does.
+*/
+
+static void
+count_write(mtd_device_t *device)
+{
+	char path[PATH_MAX];
+	uint64_t generation = 0;
+	int fd;
+
+	generation_path(device->name, path, sizeof(path));
+
+	if (0 > (fd = open(path, O_RDWR | O_CREAT, 0644))) {
+		fprintf(stderr, "Unable to open %s : %s, readers may not see "
+			"the write\n", path, strerror(errno));
+
+		return;
+	}
+
+	if (sizeof(generation) != pread(fd, &generation, sizeof(generation), 0))
+		generation = 0;
+
+	++generation;
+
+	if (sizeof(generation) != pwrite(fd, &generation, sizeof(generation), 0))
+		fprintf(stderr, "Unable to write %s : %s, readers may not see "
+			"the write\n", path, strerror(errno));
+
+	close(fd);
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_set_lock_wait
+
+  Sets how many seconds to wait for a partition another process is
+  using, LOCK_WAIT by default.
+*/
+
+void
+mtd_set_lock_wait(unsigned long seconds)
+{
+	lock_wait_ = seconds;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_lock
+
+  Locks the partition, shared or exclusive.  Calls nest, the partition
+  is unlocked by the last mtd_unlock().  An exclusive call nested in a
+  shared one converts the lock, which then stays exclusive until the
+  last mtd_unlock().  The conversion isn't atomic, another process may
+  write in between, so anything read under the shared lock should be
+  read again.
+*/
+
+int
+mtd_lock(mtd_device_t *device, int exclusive)
+{
+	if ((0 == device->locks || (exclusive && !device->exclusive)) &&
+	    0 != lock_fd(device->fd, device->name, exclusive)) {
+		/* a failed conversion drops the shared lock, take it back */
+		if (0 != device->locks &&
+		    0 != lock_fd(device->fd, device->name, 0))
+			fprintf(stderr, "%s is no longer locked\n",
+				device->name);
+
+		return -1;
+	}
+
+	if (0 == device->locks || exclusive)
+		device->exclusive = exclusive;
+
+	++device->locks;
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_unlock
+*/
+
+void
+mtd_unlock(mtd_device_t *device)
+{
+	if (0 < device->locks && 0 == --device->locks) {
+		if (device->exclusive && device->dirty)
+			count_write(device);
+
+		flock(device->fd, LOCK_UN);
+		device->exclusive = 0;
+		device->dirty = 0;
+	}
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_generation
+
+  Returns the write generation of the partition, 0 if it hasn't been
+  written since GENERATION_DIRECTORY was emptied (at boot).  A read made
+  after this is called is at least as new as the generation returned.
+*/
+
+unsigned long
+mtd_generation(const char *partition)
+{
+	char path[PATH_MAX];
+	uint64_t generation = 0;
+	int fd;
+
+	generation_path(partition, path, sizeof(path));
+
+	if (0 <= (fd = open(path, O_RDONLY))) {
+		if (sizeof(generation) != pread(fd, &generation,
+						sizeof(generation), 0))
+			generation = 0;
+
+		close(fd);
+	}
+
+	return (unsigned long)generation;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_open
+*/
+
+int
+mtd_open(mtd_device_t *device, const char *partition, int flags)
+{
+	unsigned long long timer = stats_start();
+
+	device->name = partition;
+	device->locks = 0;
+	device->exclusive = 0;
+	device->dirty = 0;
+
+	if (0 > (device->fd = open(partition, flags))) {
+		fprintf(stderr, "Unable to open %s : %s\n",
+			partition, strerror(errno));
+
+		return -1;
+	}
+
+	stats_stop(PHASE_OPEN, timer, 0);
+	timer = stats_start();
+
+	if (0 > ioctl(device->fd, MEMGETINFO, &device->info)) {
+		fprintf(stderr, "ioctl() failed on %s : %s\n",
+			partition, strerror(errno));
+		close(device->fd);
+		device->fd = -1;
+
+		return -1;
+	}
+
+	stats_stop(PHASE_MEMGETINFO, timer, 0);
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_close
+*/
+
+void
+mtd_close(mtd_device_t *device)
+{
+	if (0 <= device->fd)
+		close(device->fd);
+
+	device->fd = -1;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  is_blank
+
+  Returns 1 if length bytes at data are all 0xff, as erased flash reads.
+  The middle is checked 64 bytes at a time with vector ANDs, which the
+  compiler turns into SSE or NEON even without optimization.
+*/
+
+/* fixed width lanes, unsigned long would be 4 lanes on 32 bit ARM */
+typedef uint64_t blank_vector_t __attribute__((vector_size(16)));
+
+#define BLANK_LANES (sizeof(blank_vector_t) / sizeof(uint64_t))
+
+static int
+is_blank(const unsigned char *data, unsigned long length)
+{
+	const blank_vector_t *vector;
+	blank_vector_t all;
+	uint64_t lanes;
+	unsigned long count;
+	unsigned int lane;
+
+	for (; 0 < length && 0 != ((uintptr_t)data % sizeof(blank_vector_t));
+	     ++data, --length)
+		if (0xff != *data)
+			return 0;
+
+	vector = (const blank_vector_t *)data;
+
+	for (count = length / (4 * sizeof(blank_vector_t)); 0 < count;
+	     --count, vector += 4) {
+		all = vector[0] & vector[1] & vector[2] & vector[3];
+
+		for (lanes = ~0ULL, lane = 0; lane < BLANK_LANES; ++lane)
+			lanes &= all[lane];
+
+		if (~0ULL != lanes)
+			return 0;
+	}
+
+	data = (const unsigned char *)vector;
+	length %= 4 * sizeof(blank_vector_t);
+
+	for (; 0 < length; ++data, --length)
+		if (0xff != *data)
+			return 0;
+
+	return 1;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  program_block
+
+  Programs length bytes of an erased block, leaving out the pages that
+  are blank.  Runs of pages that aren't are written with one write.
+*/
+
+static int
+program_block(mtd_device_t *device, const unsigned char *data,
+	      unsigned long length, unsigned long block, unsigned long *skipped)
+{
+	unsigned long page = device->info.writesize;
+	unsigned long start;
+	unsigned long end;
+	unsigned long size;
+	unsigned long long timer;
+
+	/* NOR has a writesize of 1, check it in its usual program pages */
+	if (MTD_BLANK_PAGE > page)
+		page = MTD_BLANK_PAGE;
+
+	for (start = 0; start < length; start = end) {
+		size = (page < (length - start)) ? page : (length - start);
+		end = start + size;
+
+		if (is_blank(data + start, size)) {
+			++*skipped;
+			continue;
+		}
+
+		while (end < length) {
+			size = (page < (length - end)) ? page : (length - end);
+
+			if (is_blank(data + end, size))
+				break;
+
+			end += size;
+		}
+
+		timer = stats_start();
+
+		if (0 != io_write(device->fd, data + start, end - start,
+				  block + start, device->info.writesize)) {
+			fprintf(stderr, "Error writing %s: %s\n",
+				device->name, strerror(errno));
+
+			return -1;
+		}
+
+		stats_stop(PHASE_PROGRAM, timer, end - start);
+	}
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  The write journal
+
+  A write of a file to a partition can be journaled in a small file, one
+  per partition, that records how many erase blocks have been written
+  and read back, and the crc32 of the input they hold.  The journal is
+  replaced with rename() after each block, so it is always either the
+  old or the new record, and removed when the write completes.  The
+  input is identified by its length and the crc32 of what was written,
+  so a resumed write only needs the input to start the same, and the
+  crc32 is taken as the input is written, without reading it first.
+*/
+
+#define JOURNAL_MAGIC 0x4253504a	/* "BSPJ" */
+
+typedef struct journal_record {
+	uint32_t magic;
+	uint32_t erasesize;
+	uint32_t length;	/* of the input */
+	uint32_t blocks;	/* erase blocks written and verified */
+	uint32_t crc;		/* of the input in those blocks */
+	uint32_t rcrc;		/* of the fields before it */
+} journal_record_t;
+
+typedef struct journal {
+	char path[PATH_MAX];
+	journal_record_t record;
+	int failed;		/* unable to save, the write goes on without */
+} journal_t;
+
+/*
+  ------------------------------------------------------------------------------
+  journal_save
 */
 
-uint32_t
-get_crc32(void *start, unsigned long size)
+static void
+journal_save(journal_t *journal)
 {
-	unsigned long crc = 0xffffffffUL;
-	unsigned long index;
-	unsigned char *data = start;
+	char path[PATH_MAX + 4];
+	int fd;
 
-	for (index = 0; index < size; index++) {
-		unsigned long temp = (crc ^ *(data++)) & 0x000000ff;
-		crc = ((crc >> 8) & 0x00ffffff) ^ crc32_look_up_table_[temp];
-	}
+	if (journal->failed)
+		return;
 
-	return ~crc;
+	journal->record.rcrc = get_crc32(&journal->record,
+					 offsetof(journal_record_t, rcrc));
+	snprintf(path, sizeof(path), "%s.new", journal->path);
+
+	if (0 > (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) ||
+	    sizeof(journal_record_t) != write(fd, &journal->record,
+					      sizeof(journal_record_t)) ||
+	    0 != fsync(fd) || 0 != close(fd) ||
+	    0 != rename(path, journal->path)) {
+		fprintf(stderr, "Unable to save the journal %s : %s, the write "
+			"can't be resumed\n", journal->path, strerror(errno));
+
+		if (0 <= fd)
+			close(fd);
+
+		unlink(path);
+		journal->failed = 1;
+	}
 }
 
 /*
   ------------------------------------------------------------------------------
-  get_partition_size_
+  journal_resume
+
+  Returns the erase block to resume the write at, 0 unless the journal
+  is for this input and the blocks it lists still hold it.
 */
 
-int
-get_mtd_partition_info(const char *partition,
-		       struct mtd_info_user *mtd_info)
+static unsigned long
+journal_resume(journal_t *journal, mtd_device_t *device, FILE *input,
+	       void *buffer, unsigned long size)
 {
+	journal_record_t saved;
+	unsigned long length;
+	unsigned long offset;
+	unsigned long piece;
+	uint32_t crc = 0;
+	uint32_t input_crc = 0;
 	int fd;
 
-	if (0 > (fd = open(partition, O_RDWR))) {
-		fprintf(stderr, "Unable to open %s : %s\n",
-			partition, strerror(errno));
+	if (0 > (fd = open(journal->path, O_RDONLY))) {
+		fprintf(stderr, "No journal for %s, writing all of it\n",
+			device->name);
 
-		return -1;
+		return 0;
 	}
 
-	if (0 > ioctl(fd, MEMGETINFO, mtd_info)) {
-		fprintf(stderr, "ioctl() failed on %s : %s\n",
-			partition, strerror(errno));
+	if (sizeof(saved) != read(fd, &saved, sizeof(saved)) ||
+	    JOURNAL_MAGIC != saved.magic ||
+	    saved.rcrc != get_crc32(&saved, offsetof(journal_record_t, rcrc))) {
+		fprintf(stderr, "%s is not a valid journal, writing all of %s\n",
+			journal->path, device->name);
+		close(fd);
 
-		return -1;
+		return 0;
 	}
 
 	close(fd);
 
+	if (saved.erasesize != journal->record.erasesize ||
+	    saved.length != journal->record.length) {
+		fprintf(stderr, "%s was for another input, writing all of %s\n",
+			journal->path, device->name);
+
+		return 0;
+	}
+
+	/* what the journal says is written must still be there */
+	length = (unsigned long)saved.blocks * saved.erasesize;
+
+	if (length > saved.length)
+		length = saved.length;
+
+	for (offset = 0; offset < length; offset += piece) {
+		piece = (size < (length - offset)) ? size : (length - offset);
+
+		if (0 != io_read(device->fd, buffer, piece, offset)) {
+			fprintf(stderr, "Error reading %s at 0x%lx: %s\n",
+				device->name, offset, strerror(errno));
+
+			return 0;
+		}
+
+		crc = update_crc32(crc, buffer, piece);
+
+		if (piece != fread(buffer, 1, piece, input)) {
+			fprintf(stderr, "Error reading the input: %s\n",
+				strerror(errno));
+
+			return 0;
+		}
+
+		input_crc = update_crc32(input_crc, buffer, piece);
+	}
+
+	if (crc != saved.crc) {
+		fprintf(stderr, "%s doesn't hold what %s says, writing all "
+			"of it\n", device->name, journal->path);
+
+		return 0;
+	}
+
+	if (input_crc != saved.crc) {
+		fprintf(stderr, "%s was for another input, writing all of %s\n",
+			journal->path, device->name);
+
+		return 0;
+	}
+
+	journal->record = saved;
+
+	return saved.blocks;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  verify_block
+
+  Reads back length bytes at block and compares them with data.
+*/
+
+static int
+verify_block(mtd_device_t *device, const unsigned char *data,
+	     unsigned long length, unsigned long block)
+{
+	unsigned char piece[4096];
+	unsigned long offset;
+	unsigned long size;
+	unsigned long long timer;
+
+	timer = stats_start();
+
+	for (offset = 0; offset < length; offset += size) {
+		size = (sizeof(piece) < (length - offset)) ?
+			sizeof(piece) : (length - offset);
+
+		if (0 != io_read(device->fd, piece, size, block + offset)) {
+			fprintf(stderr, "Error reading %s at 0x%lx: %s\n",
+				device->name, block + offset, strerror(errno));
+
+			return -1;
+		}
+
+		if (0 != memcmp(piece, data + offset, size)) {
+			fprintf(stderr, "%s doesn't read back as written at "
+				"0x%lx\n", device->name, block + offset);
+
+			return -1;
+		}
+	}
+
+	stats_stop(PHASE_VERIFY, timer, length);
+
 	return 0;
 }
 
 /*
   ------------------------------------------------------------------------------
-  get_mtd_partition
+  write_blocks
+
+  Does the work of mtd_write_stream() and mtd_write().  With a journal,
+  the write starts at the erase block it records, which the input must
+  be positioned at, and each block is read back and recorded.  With
+  first, the first erase block is erased but what it should hold is
+  copied to first instead of being programmed.
 */
 
-int
-get_mtd_partition(void *output, unsigned long size, const char *partition)
+static int
+write_blocks(mtd_device_t *device, FILE *input, unsigned long length,
+	     void *buffer, unsigned long size,
+	     int (*check)(const void *, unsigned long), uint32_t *crc,
+	     unsigned long *skipped, journal_t *journal, void *first)
 {
-	int fd;
-    int tmp;
+	struct mtd_info_user *mtd_info = &device->info;
+	struct erase_info_user erase;
+	unsigned long chunk;
+	unsigned long offset = 0;
+	unsigned long filled;
+	unsigned long block;
+	unsigned long program;
+	unsigned long blank = 0;
+	unsigned long long started;
+	unsigned long long timer;
+	uint32_t input_crc = 0;
 
-	if (0 > (fd = open(partition, O_RDWR))) {
-		fprintf(stderr, "Unable to open %s : %s\n",
-			partition, strerror(errno));
+	if (length > mtd_info->size) {
+		fprintf(stderr, "%lu bytes don't fit in %s (%u bytes)\n",
+			length, device->name, mtd_info->size);
 
 		return -1;
 	}
-	if (0 > (tmp = lseek(fd, 0, SEEK_SET))) {
-		fprintf(stderr, "Unable to rewind partition: %s\n",
-			strerror(errno));
-		close(fd);
+
+	if (0 == mtd_info->erasesize ||
+	    0 == (chunk = size - (size % mtd_info->erasesize))) {
+		fprintf(stderr, "Buffer too small for a %u byte erase block\n",
+			mtd_info->erasesize);
 
 		return -1;
 	}
 
-	if (size != (tmp=read(fd, output, size))) {
-		fprintf(stderr, "Unable to read the partition : %s\n",
-			strerror(errno));
-		close(fd);
+	if (NULL != journal)
+		offset = (unsigned long)journal->record.blocks *
+			mtd_info->erasesize;
 
-		return -1;
+	for (; offset < mtd_info->size; offset += chunk) {
+		filled = 0;
+
+		if (offset < length) {
+			filled = length - offset;
+
+			if (filled > chunk)
+				filled = chunk;
+
+			timer = stats_start();
+
+			if (filled != fread(buffer, 1, filled, input)) {
+				fprintf(stderr, "Error reading the input at 0x%lx: %s\n",
+					offset, ferror(input) ? strerror(errno) :
+					"unexpected end");
+
+				return -1;
+			}
+
+			stats_stop(PHASE_INPUT, timer, filled);
+
+			if (NULL != crc)
+				input_crc = update_crc32(input_crc, buffer,
+							 filled);
+
+			if (0 == offset && NULL != check &&
+			    0 != check(buffer, filled))
+				return -1;
+		}
+
+		/* An erase block at a time, so each one can be timed. */
+		for (block = offset;
+		     block < (offset + chunk) && block < mtd_info->size;
+		     block += mtd_info->erasesize) {
+			started = monotonic();
+			erase.start = block;
+			erase.length = mtd_info->erasesize;
+			timer = stats_start();
+			device->dirty = 1;
+
+			if (0 > ioctl(device->fd, MEMERASE, &erase)) {
+				fprintf(stderr, "Error erasing %s: %s\n",
+					device->name, strerror(errno));
+
+				return -1;
+			}
+
+			stats_stop(PHASE_ERASE, timer, erase.length);
+			program = 0;
+
+			if (block < (offset + filled)) {
+				program = offset + filled - block;
+
+				if (program > mtd_info->erasesize)
+					program = mtd_info->erasesize;
+
+				if (NULL != first && 0 == block)
+					memcpy(first, buffer, program);
+				else if (0 != program_block(device,
+							    buffer + (block - offset),
+							    program, block, &blank))
+					return -1;
+			}
+
+			if (NULL != journal) {
+				if (0 != verify_block(device,
+						      buffer + (block - offset),
+						      program, block))
+					return -1;
+
+				journal->record.crc =
+					update_crc32(journal->record.crc,
+						     buffer + (block - offset),
+						     program);
+				++journal->record.blocks;
+				journal_save(journal);
+			}
+
+			qos_pace(started, mtd_info->erasesize,
+				 mtd_info->size - block - mtd_info->erasesize);
+		}
 	}
 
-	close(fd);
+	if (NULL != crc)
+		*crc = input_crc;
+
+	if (NULL != skipped)
+		*skipped = blank;
 
 	return 0;
 }
 
+/*
+  ------------------------------------------------------------------------------
+  mtd_write_stream
+
+  Erases the whole partition and programs length bytes from input at
+  the start of it, as they are read.  The input is read into buffer in
+  chunks of as many erase blocks as fit, each erase block is then erased
+  and programmed in turn.  If check isn't NULL it is given the first
+  chunk, and nothing is erased unless it returns 0.  Pages of the input
+  that are all 0xff are already that once erased, they aren't programmed
+  and skipped, if not NULL, is set to how many there were.
 
+  The first erase block, with the image header, is kept in first, which
+  holds an erase block, and only programmed once all of input has been
+  written and its crc32 is crc.  Until then, and for good if it isn't,
+  the partition holds no image that a boot loader would take.
+*/
 
-int mtd_write(const char *device, const char *input)
+int
+mtd_write_stream(mtd_device_t *device, FILE *input, unsigned long length,
+		 void *buffer, unsigned long size, void *first,
+		 int (*check)(const void *, unsigned long), uint32_t crc,
+		 unsigned long *skipped)
 {
-	struct mtd_info_user mtd_info;
-	struct stat input_stat;
-	FILE *image_file = NULL;
-	void *image = NULL;
-	int mtd_fd;
-	struct erase_info_user erase;
-	int selected;
-	char buffer[11];
+	unsigned long program;
+	unsigned long blank = 0;
+	uint32_t written;
+	int return_value;
 
-	if (0 != get_mtd_partition_info(device, &mtd_info)) {	
-		fprintf(stderr, "Error Getting MTD Info!\n");
-		goto cleanup;
+	if (0 != mtd_lock(device, 1))
+		return -1;
+
+	return_value = write_blocks(device, input, length, buffer, size,
+				    check, &written, skipped, NULL, first);
+
+	if (0 == return_value && written != crc) {
+		fprintf(stderr, "%s input crc32 0x%08x isn't 0x%08x, its first "
+			"erase block is left erased\n", device->name,
+			written, crc);
+		return_value = -1;
+	}
+
+	if (0 == return_value && 0 != length) {
+		program = (length < device->info.erasesize) ?
+			length : device->info.erasesize;
+		return_value = program_block(device, first, program, 0, &blank);
+
+		if (NULL != skipped)
+			*skipped += blank;
 	}
 
+	mtd_unlock(device);
+
+	return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_write
+
+  Writes the file input like mtd_write_stream().  With MTD_WRITE_JOURNAL
+  each erase block is also read back and recorded in a journal in
+  JOURNAL_DIRECTORY.  With MTD_WRITE_RESUME, if the journal of an
+  interrupted write of the same input checks out, the blocks it records
+  aren't written again.
+*/
+
+int
+mtd_write(mtd_device_t *device, const char *input,
+	  void *buffer, unsigned long size, unsigned long *skipped,
+	  mtd_write_mode_t mode)
+{
+	struct stat input_stat;
+	FILE *image_file = NULL;
+	journal_t journal;
+	const char *name;
+	unsigned long offset;
+	int locked = 0;
+	int return_value = -1;
+
 	if (0 != stat(input, &input_stat)) {
 		fprintf(stderr, "Error reading %s: %s\n",
 			input, strerror(errno));
 		goto cleanup;
 	}
 
+	if (input_stat.st_size > device->info.size) {
+		fprintf(stderr, "%s doesn't fit in %s (%u bytes)\n",
+			input, device->name, device->info.size);
+		goto cleanup;
+	}
+
 	if (NULL == (image_file = fopen(input, "rb"))) {
 		fprintf(stderr, "Error opening %s: %s\n",
 			input, strerror(errno));
 		goto cleanup;
 	}
 
-	image = malloc(input_stat.st_size);
+	if (0 != mtd_lock(device, 1))
+		goto cleanup;
 
-	if (input_stat.st_size !=
-	    fread(image, 1, input_stat.st_size, image_file)) {
-		fprintf(stderr, "Error reading %s: %s\n",
-			input, strerror(errno));
+	locked = 1;
+
+	if (MTD_WRITE_PLAIN == mode) {
+		return_value = write_blocks(device, image_file,
+					    input_stat.st_size, buffer, size,
+					    NULL, NULL, skipped, NULL, NULL);
 		goto cleanup;
 	}
 
-	if (0 > (mtd_fd = open(device, O_RDWR))) {
-		fprintf(stderr, "Error opening %s: %s\n",
-			device, strerror(errno));
+	memset(&journal, 0, sizeof(journal));
+	name = (NULL == strrchr(device->name, '/')) ?
+		device->name : strrchr(device->name, '/') + 1;
+	snprintf(journal.path, sizeof(journal.path), "%s/image-%s.journal",
+		 JOURNAL_DIRECTORY, name);
+	journal.record.magic = JOURNAL_MAGIC;
+	journal.record.erasesize = device->info.erasesize;
+	journal.record.length = input_stat.st_size;
+
+	if (MTD_WRITE_RESUME == mode &&
+	    0 != journal_resume(&journal, device, image_file, buffer, size))
+		printf("resuming %s at erase block %u of %u\n", device->name,
+		       journal.record.blocks,
+		       device->info.size / device->info.erasesize);
+
+	offset = (unsigned long)journal.record.blocks * device->info.erasesize;
+
+	if (0 != fseek(image_file, (offset < input_stat.st_size) ?
+		       offset : input_stat.st_size, SEEK_SET)) {
+		fprintf(stderr, "Error seeking %s: %s\n",
+			input, strerror(errno));
 		goto cleanup;
 	}
 
-	erase.start = 0;
-	erase.length = mtd_info.size;
+	return_value = write_blocks(device, image_file, input_stat.st_size,
+				    buffer, size, NULL, NULL, skipped, &journal,
+				    NULL);
 
-	if (0 > ioctl(mtd_fd, MEMERASE, &erase)) {
-		fprintf(stderr, "Error erasing %s: %s\n",
-			device, strerror(errno));
-		goto cleanup;
+	/* a failed write keeps its journal, to be resumed */
+	if (0 == return_value)
+		unlink(journal.path);
+
+cleanup:
+
+	if (locked)
+		mtd_unlock(device);
+
+	if (NULL != image_file)
+		fclose(image_file);
+
+	return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  clone_blocks
+*/
+
+static int
+clone_blocks(mtd_device_t *device, mtd_device_t *source,
+	     void *device_block, void *source_block,
+	     const unsigned char *device_map, const unsigned char *source_map,
+	     unsigned long *skipped, uint32_t *crc)
+{
+	struct mtd_info_user *device_info = &device->info;
+	struct mtd_info_user *source_info = &source->info;
+	struct erase_info_user erase;
+	const void *source_data;
+	const void *device_data;
+	unsigned long offset;
+	uint32_t device_crc = 0;
+	uint32_t source_crc = 0;
+	unsigned long long started;
+	unsigned long long timer;
+
+	if (source_info->type != device_info->type ||
+	    source_info->size != device_info->size ||
+	    source_info->erasesize != device_info->erasesize ||
+	    source_info->writesize != device_info->writesize ||
+	    0 == source_info->erasesize ||
+	    0 != (source_info->size % source_info->erasesize)) {
+		fprintf(stderr, "%s and %s don't have the same geometry\n",
+			source->name, device->name);
+
+		return -1;
+	}
+
+	*skipped = 0;
+
+	for (offset = 0; offset < device_info->size;
+	     offset += device_info->erasesize) {
+		started = monotonic();
+		source_data = (NULL != source_map) ?
+			source_map + offset : source_block;
+		device_data = (NULL != device_map) ?
+			device_map + offset : device_block;
+
+		if (NULL == source_map) {
+			timer = stats_start();
+
+			if (0 != io_read(source->fd, source_block,
+					 source_info->erasesize, offset)) {
+				fprintf(stderr, "Error reading %s at 0x%lx: %s\n",
+					source->name, offset, strerror(errno));
+
+				return -1;
+			}
+
+			stats_stop(PHASE_READ, timer, source_info->erasesize);
+		}
+
+		source_crc = update_crc32(source_crc, (void *)source_data,
+					  source_info->erasesize);
+
+		if (NULL == device_map) {
+			timer = stats_start();
+
+			if (0 != io_read(device->fd, device_block,
+					 device_info->erasesize, offset)) {
+				fprintf(stderr, "Error reading %s at 0x%lx: %s\n",
+					device->name, offset, strerror(errno));
+
+				return -1;
+			}
+
+			stats_stop(PHASE_READ, timer, device_info->erasesize);
+		}
+
+		if (0 == memcmp(source_data, device_data,
+				device_info->erasesize)) {
+			device_crc = update_crc32(device_crc, (void *)device_data,
+						  device_info->erasesize);
+			++*skipped;
+			continue;
+		}
+
+		erase.start = offset;
+		erase.length = device_info->erasesize;
+		timer = stats_start();
+		device->dirty = 1;
+
+		if (0 > ioctl(device->fd, MEMERASE, &erase)) {
+			fprintf(stderr, "Error erasing %s at 0x%lx: %s\n",
+				device->name, offset, strerror(errno));
+
+			return -1;
+		}
+
+		stats_stop(PHASE_ERASE, timer, erase.length);
+		timer = stats_start();
+
+		if (0 != io_write(device->fd, source_data,
+				  device_info->erasesize, offset,
+				  device_info->writesize)) {
+			fprintf(stderr, "Error writing %s at 0x%lx: %s\n",
+				device->name, offset, strerror(errno));
+
+			return -1;
+		}
+
+		stats_stop(PHASE_PROGRAM, timer, device_info->erasesize);
+
+		if (NULL == device_map) {
+			timer = stats_start();
+
+			if (0 != io_read(device->fd, device_block,
+					 device_info->erasesize, offset)) {
+				fprintf(stderr, "Error reading %s at 0x%lx: %s\n",
+					device->name, offset, strerror(errno));
+
+				return -1;
+			}
+
+			stats_stop(PHASE_VERIFY, timer, device_info->erasesize);
+		}
+
+		device_crc = update_crc32(device_crc, (void *)device_data,
+					  device_info->erasesize);
+
+		/* only blocks that were written, matching ones cost little */
+		qos_pace(started, device_info->erasesize,
+			 device_info->size - offset - device_info->erasesize);
+	}
+
+	if (device_crc != source_crc) {
+		fprintf(stderr, "crc32 of %s (0x%08x) doesn't match %s (0x%08x)\n",
+			device->name, device_crc, source->name, source_crc);
+
+		return -1;
+	}
+
+	*crc = device_crc;
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_clone
+
+  Copies the source partition onto the device partition one erase block
+  at a time, without staging it in a file.  Blocks that already match
+  are neither erased nor programmed.  The result is checked by comparing
+  the crc32 of the source with the crc32 of what was read back.  Each
+  block buffer must hold an erase block.  The source is locked shared
+  and the device exclusive while they are used.
+
+  If device_map or source_map isn't NULL it is a read only mapping of
+  the whole partition (see reader_map()), which is compared and
+  checksummed in place, and its block buffer isn't used.
+*/
+
+int
+mtd_clone(mtd_device_t *device, mtd_device_t *source,
+	  void *device_block, void *source_block,
+	  const void *device_map, const void *source_map,
+	  unsigned long *skipped, uint32_t *crc)
+{
+	int return_value = -1;
+
+	if (0 != mtd_lock(source, 0))
+		return -1;
+
+	if (0 == mtd_lock(device, 1)) {
+		return_value = clone_blocks(device, source, device_block,
+					    source_block, device_map,
+					    source_map, skipped, crc);
+		mtd_unlock(device);
+	}
+
+	mtd_unlock(source);
+
+	return return_value;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  Scrubbing
+
+  A block is scrubbed by reading it and seeing how much the ECC had to
+  correct, from the ECCGETSTATS counts before and after the read.  The
+  counts are for the whole chip, so a read of another partition at the
+  same time adds to them; a block is only ever blamed for too much.
+  NOR has no ECC, its counts stay at 0.
+*/
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_scrub_read
+
+  Reads the erase block at offset into block and sets *scrub to what
+  the ECC made of it.  A bad block isn't read.  Uncorrectable errors
+  aren't an error here, scrub->failed is set and block is left as it
+  was.
+*/
+
+int
+mtd_scrub_read(mtd_device_t *device, void *block, unsigned long offset,
+	       mtd_scrub_t *scrub)
+{
+	struct mtd_ecc_stats before;
+	struct mtd_ecc_stats after;
+	loff_t position = offset;
+	unsigned long long timer;
+	int failed = 0;
+
+	memset(scrub, 0, sizeof(mtd_scrub_t));
+
+	/* only NAND has bad blocks, anything else says it has none */
+	if (0 < ioctl(device->fd, MEMGETBADBLOCK, &position)) {
+		scrub->bad = 1;
+
+		return 0;
+	}
+
+	if (0 != ioctl(device->fd, ECCGETSTATS, &before))
+		memset(&before, 0, sizeof(before));
+
+	timer = stats_start();
+
+	if (0 != io_read(device->fd, block, device->info.erasesize, offset)) {
+		if (EBADMSG != errno) {
+			fprintf(stderr, "Error reading %s at 0x%lx: %s\n",
+				device->name, offset, strerror(errno));
+
+			return -1;
+		}
+
+		failed = 1;
 	}
 
-	if (0 > lseek(mtd_fd, 0, SEEK_SET)) {
-		fprintf(stderr, "Error rewinding %s: %s\n",
-			device, strerror(errno));
+	stats_stop(PHASE_READ, timer, device->info.erasesize);
+
+	if (0 != ioctl(device->fd, ECCGETSTATS, &after))
+		after = before;
+
+	scrub->corrected = after.corrected - before.corrected;
+	scrub->failed = after.failed - before.failed;
+
+	if (failed && 0 == scrub->failed)
+		scrub->failed = 1;
+
+	return 0;
+}
+
+/*
+  ------------------------------------------------------------------------------
+  mtd_scrub_rewrite
+
+  Erases the erase block at offset and programs block, as read by
+  mtd_scrub_read(), back into it, refreshing cells that have started to
+  lose their charge.  generation is mtd_generation() of the partition
+  when block was read, with a lock held.  If the partition has been
+  written since, block may be out of date, it isn't written back and 1
+  is returned.  Blank pages aren't programmed, skipped, if not NULL, is
+  added to for each.  The exclusive lock is only held for the rewrite,
+  which is paced like any other write, outside it.
+*/
+
+int
+mtd_scrub_rewrite(mtd_device_t *device, const void *block,
+		  unsigned long offset, unsigned long generation,
+		  unsigned long *skipped)
+{
+	struct erase_info_user erase;
+	unsigned long blank = 0;
+	unsigned long long started = monotonic();
+	unsigned long long timer;
+	int return_value = -1;
+
+	if (0 != mtd_lock(device, 1))
+		return -1;
+
+	if (generation != mtd_generation(device->name)) {
+		fprintf(stderr, "%s was written after 0x%lx was read, not "
+			"rewriting it\n", device->name, offset);
+		return_value = 1;
 		goto cleanup;
 	}
 
-	if (input_stat.st_size != write(mtd_fd, image, input_stat.st_size)) {
-		fprintf(stderr, "Error writing %s: %s\n",
-			device, strerror(errno));
+	erase.start = offset;
+	erase.length = device->info.erasesize;
+	timer = stats_start();
+	device->dirty = 1;
+
+	if (0 > ioctl(device->fd, MEMERASE, &erase)) {
+		fprintf(stderr, "Error erasing %s at 0x%lx: %s\n",
+			device->name, offset, strerror(errno));
 		goto cleanup;
 	}
 
+	stats_stop(PHASE_ERASE, timer, erase.length);
+
+	if (0 != program_block(device, block, device->info.erasesize,
+			       offset, &blank) ||
+	    0 != verify_block(device, block, device->info.erasesize, offset))
+		goto cleanup;
+
+	if (NULL != skipped)
+		*skipped += blank;
+
+	return_value = 0;
+
 cleanup:
 
-	if (NULL != image_file)
-		fclose(image_file);
-	
-	if (NULL != image)
-		free(image);
+	mtd_unlock(device);
 
-	if (0 != mtd_fd)
-		close(mtd_fd);
+	if (0 == return_value)
+		qos_pace(started, device->info.erasesize, 0);
 
-	return 0;
+	return return_value;
 }
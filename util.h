@@ -21,12 +21,110 @@
 #ifndef __UTIL__H__
 #define __UTIL__H__
 
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 #define __user
 #include <mtd/mtd-user.h>
 
+typedef enum {
+	PHASE_OPEN,
+	PHASE_MEMGETINFO,
+	PHASE_ERASE,
+	PHASE_PROGRAM,
+	PHASE_READ,
+	PHASE_VERIFY,
+	PHASE_CHECKSUM,
+	PHASE_LOCK,
+	PHASE_PACE,
+	PHASE_INPUT,		/* reads of the file or stream written */
+	PHASE_COUNT
+} phase_t;
+
+typedef struct mtd_reader {
+	int fd;
+	const char *name;
+	unsigned long size;
+	void *window;
+	unsigned long window_size;
+	unsigned long window_offset;
+	unsigned long window_length;
+	int mapped;		/* window is an mmap() of the whole size */
+} mtd_reader_t;
+
+void stats_enable(void);
+unsigned long long stats_start(void);
+void stats_stop(phase_t phase, unsigned long long start, unsigned long bytes);
+void stats_print(FILE *output, int json);
+
+typedef struct mtd_device {
+	int fd;
+	const char *name;
+	struct mtd_info_user info;
+	int locks;		/* mtd_lock() calls not yet unlocked */
+	int exclusive;		/* the lock held is exclusive */
+	int dirty;		/* erased since the lock was taken */
+} mtd_device_t;
+
+typedef struct mtd_scrub {
+	int bad;			/* a bad block, not read */
+	unsigned long corrected;	/* bitflips the ECC corrected */
+	unsigned long failed;		/* ECC failures, the data is wrong */
+} mtd_scrub_t;
+
+typedef enum {
+	MTD_WRITE_PLAIN,
+	MTD_WRITE_JOURNAL,	/* read back and journal each erase block */
+	MTD_WRITE_RESUME	/* and first carry on from the journal */
+} mtd_write_mode_t;
+
+int arena_init(unsigned long size);
+void *arena_alloc(unsigned long size);
+void arena_free(void *buffer);
+int arena_enabled(void);
+unsigned long arena_chunk(unsigned long unit, unsigned long wanted);
+
+void io_set_deadline(unsigned long);
+int io_read(int, void *, unsigned long, unsigned long);
+int io_write(int, const void *, unsigned long, unsigned long, unsigned long);
+
+void qos_set_rate(unsigned long);
+void qos_set_duty(unsigned int);
+void qos_set_finish(time_t);
+int qos_background(void);
+
+int reader_attach(mtd_reader_t *, int, const char *,
+		  unsigned long, unsigned long);
+int reader_map(mtd_reader_t *, int, const char *,
+	       unsigned long, unsigned long);
+void reader_close(mtd_reader_t *);
+const void *reader_get(mtd_reader_t *, unsigned long, unsigned long);
+long reader_find(mtd_reader_t *, unsigned long, const void *, unsigned long);
+const char *reader_string(mtd_reader_t *, unsigned long);
+
 uint32_t get_crc32(void *, unsigned long);
-int get_mtd_partition_info(const char *, struct mtd_info_user *);
-int get_mtd_partition(void *, unsigned long, const char *);
-int mtd_write(const char *device, const char *input);
+uint32_t update_crc32(uint32_t, void *, unsigned long);
+int mtd_open(mtd_device_t *, const char *, int);
+void mtd_close(mtd_device_t *);
+void mtd_set_lock_wait(unsigned long);
+int mtd_lock(mtd_device_t *, int);
+void mtd_unlock(mtd_device_t *);
+unsigned long mtd_generation(const char *);
+int mtd_write_stream(mtd_device_t *device, FILE *input, unsigned long length,
+		     void *buffer, unsigned long size, void *first,
+		     int (*check)(const void *, unsigned long), uint32_t crc,
+		     unsigned long *skipped);
+int mtd_write(mtd_device_t *device, const char *input,
+	      void *buffer, unsigned long size, unsigned long *skipped,
+	      mtd_write_mode_t mode);
+int mtd_clone(mtd_device_t *device, mtd_device_t *source,
+	      void *device_block, void *source_block,
+	      const void *device_map, const void *source_map,
+	      unsigned long *skipped, uint32_t *crc);
+int mtd_scrub_read(mtd_device_t *device, void *block, unsigned long offset,
+		   mtd_scrub_t *scrub);
+int mtd_scrub_rewrite(mtd_device_t *device, const void *block,
+		      unsigned long offset, unsigned long generation,
+		      unsigned long *skipped);
 
 #endif /* __UTIL__H__ */